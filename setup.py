@@ -1,11 +1,69 @@
 #!/usr/bin/python
 # -*- coding: iso-8859-1 -*-
 # Copyright (C) 2007 Bastian Kleineidam
+import os
+import shutil
+import tempfile
 from distutils.core import setup, Extension
+from distutils.ccompiler import new_compiler, CompileError
+from distutils.sysconfig import customize_compiler
+
+
+def have_sdt_header ():
+    """Return True if the compiler finds sys/sdt.h and can use its
+    probe macros."""
+    tmpdir = tempfile.mkdtemp()
+    try:
+        filename = os.path.join(tmpdir, "sdt.c")
+        fp = open(filename, "w")
+        fp.write("#include <sys/sdt.h>\n"
+                 "int main (void) { DTRACE_PROBE(test, probe); return 0; }\n")
+        fp.close()
+        compiler = new_compiler()
+        customize_compiler(compiler)
+        try:
+            compiler.compile([filename], output_dir=tmpdir)
+        except CompileError:
+            return False
+        return True
+    finally:
+        shutil.rmtree(tmpdir)
+
+
+define_macros = []
+# SystemTap/USDT tracepoints, they need the systemtap-sdt headers:
+# CTEMPLATE_PROBES  "auto" (default) enables them if sys/sdt.h compiles,
+#                   "yes" always, "no" never
+probes = os.environ.get("CTEMPLATE_PROBES", "auto")
+if probes not in ("auto", "yes", "no"):
+    raise SystemExit("CTEMPLATE_PROBES must be auto, yes or no, not %r" %
+                     probes)
+if probes == "yes" or (probes == "auto" and have_sdt_header()):
+    define_macros.append(("HAVE_SYS_SDT_H", None))
+
+# Optional build against a static libctemplate, used by the pgobuild
+# target of the Makefile:
+# CTEMPLATE_STATIC  path of libctemplate.a
+# CTEMPLATE_INCLUDE colon separated list of ctemplate header directories
+# CTEMPLATE_FLAGS   extra compiler and linker flags, e.g. for LTO and PGO
+libraries = ["ctemplate", "pthread"]
+extra_objects = []
+include_dirs = []
+extra_flags = os.environ.get("CTEMPLATE_FLAGS", "").split()
+if os.environ.get("CTEMPLATE_STATIC"):
+    libraries = ["pthread"]
+    extra_objects = [os.environ["CTEMPLATE_STATIC"]]
+if os.environ.get("CTEMPLATE_INCLUDE"):
+    include_dirs = os.environ["CTEMPLATE_INCLUDE"].split(":")
 
 module1 = Extension('ctemplate',
                     sources = ['src/ctemplate.cpp'],
-                    libraries = ["ctemplate", "pthread"])
+                    define_macros = define_macros,
+                    include_dirs = include_dirs,
+                    libraries = libraries,
+                    extra_objects = extra_objects,
+                    extra_compile_args = extra_flags,
+                    extra_link_args = extra_flags)
 
 myname = "Bastian Kleineidam"
 myemail = "calvin@debian.org"
@@ -30,6 +30,40 @@ SUCH DAMAGE.
 #include "Python.h"
 #include "structmember.h" /* Python include for object definition */
 #include <ctemplate/template.h>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <unordered_map>
+#define HASH_MAP std::unordered_map
+#else
+#include <tr1/unordered_map>
+#define HASH_MAP std::tr1::unordered_map
+#endif
+#include <deque>
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/* Static tracepoints for SystemTap/bpftrace under the provider name
+   python_ctemplate. They compile to a nop when not attached, and to
+   nothing at all when sys/sdt.h was not found by setup.py. */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define CTEMPLATE_PROBE0(name) DTRACE_PROBE(python_ctemplate, name)
+#define CTEMPLATE_PROBE1(name, a) DTRACE_PROBE1(python_ctemplate, name, a)
+#define CTEMPLATE_PROBE2(name, a, b) \
+    DTRACE_PROBE2(python_ctemplate, name, a, b)
+#else
+#define CTEMPLATE_PROBE0(name)
+#define CTEMPLATE_PROBE1(name, a)
+#define CTEMPLATE_PROBE2(name, a, b)
+#endif
 
 /* Error reporting for module init functions (adapted from mxProxy) */
 #define Py_ReportModuleInitError(modname) {			\
@@ -52,14 +86,14 @@ SUCH DAMAGE.
 	PyString_Check(str_type) && PyString_Check(str_value))	\
 	PyErr_Format(						\
 		PyExc_ImportError,				\
-		"initialization of module "modname" failed "	\
+		"initialization of module " modname " failed "	\
 		"(%s:%s)",					\
 		PyString_AS_STRING(str_type),			\
 		PyString_AS_STRING(str_value));			\
     else							\
 	PyErr_SetString(					\
 		PyExc_ImportError,				\
-		"initialization of module "modname" failed");	\
+		"initialization of module " modname " failed");	\
     Py_XDECREF(str_type);					\
     Py_XDECREF(str_value);					\
     Py_XDECREF(exc_type);					\
@@ -81,16 +115,317 @@ static ctemplate::Strip strip_from_int (unsigned int i) {
     }
 }
 
+// type convert int (TC_*) -> AUTOESCAPE pragma, NULL if the template is
+// not auto-escaped; returns false for unknown values
+static bool autoescape_pragma (int i, const char** pragma) {
+    switch (i) {
+    case ctemplate::TC_UNUSED:
+    case ctemplate::TC_MANUAL:
+        *pragma = NULL;
+        return true;
+    case ctemplate::TC_HTML:
+        *pragma = "{{%AUTOESCAPE context=\"HTML\"}}";
+        return true;
+    case ctemplate::TC_JS:
+        *pragma = "{{%AUTOESCAPE context=\"JAVASCRIPT\"}}";
+        return true;
+    case ctemplate::TC_CSS:
+        *pragma = "{{%AUTOESCAPE context=\"CSS\"}}";
+        return true;
+    case ctemplate::TC_JSON:
+        *pragma = "{{%AUTOESCAPE context=\"JSON\"}}";
+        return true;
+    case ctemplate::TC_XML:
+        *pragma = "{{%AUTOESCAPE context=\"XML\"}}";
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*************************** Native timings **************************/
+/* Durations of the library calls alone, for tests/stress.py: the time
+   Python measures around a call also contains the waits for the GIL.
+   The clock is read without the GIL, the samples are added with it held
+   and only while enabled, see ctemplate._SetNativeTimings(). */
+enum {
+    TIMING_LOAD,
+    TIMING_EXPAND,
+    TIMING_EXPAND_ASYNC,
+    TIMING_RELOAD,
+    TIMING_RELOAD_ALL,
+    NUM_TIMINGS
+};
+static const char* timing_names[NUM_TIMINGS] = {
+    "GetTemplate", "Expand", "ExpandAsync", "ReloadIfChanged",
+    "ReloadAllIfChanged"
+};
+static bool timing_enabled = false;
+// seconds per call
+static std::vector<double> timings[NUM_TIMINGS];
+
+static double
+timing_now (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+timing_add (int which, double start, double end) {
+    if (timing_enabled)
+        timings[which].push_back(end - start);
+}
+
+/*********************** Template search path ***********************/
+/* Relative template filenames are looked up in each directory of the
+   search path in order, see ctemplate.SetTemplateSearchPath(). Both
+   found and missing files are cached until the search path or root
+   directory changes or all templates are reloaded, so resolving a name
+   usually costs no filesystem access. The filenames of include
+   dictionaries are resolved as well. All of this is only used with the
+   GIL held. */
+static std::vector<std::string> search_path;
+// filename -> path in the first matching directory, or "" if not found
+static HASH_MAP<std::string, std::string> resolve_cache;
+
+static void
+clear_resolve_cache (void) {
+    resolve_cache.clear();
+}
+
+/* Store the path of filename in the first search path directory
+   containing it in path. Returns false if no directory has the file. */
+static bool
+resolve_template (const std::string& filename, std::string* path) {
+    if (search_path.empty() || filename.empty() || filename[0] == '/') {
+        *path = filename;
+        return true;
+    }
+    HASH_MAP<std::string, std::string>::const_iterator it =
+        resolve_cache.find(filename);
+    if (it != resolve_cache.end()) {
+        *path = it->second;
+        return !path->empty();
+    }
+    // relative directories are below the template root directory, just
+    // like relative filenames passed to ctemplate
+    std::string root = ctemplate::Template::template_root_directory();
+    path->clear();
+    for (size_t i = 0; i < search_path.size(); i++) {
+        std::string candidate = search_path[i];
+        if (!candidate.empty() && candidate[candidate.length() - 1] != '/')
+            candidate += '/';
+        candidate += filename;
+        std::string fullpath = candidate[0] == '/' ? candidate :
+            root + candidate;
+        struct stat st;
+        if (stat(fullpath.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            *path = candidate;
+            break;
+        }
+    }
+    resolve_cache[filename] = *path;
+    return !path->empty();
+}
+
+/* The filename of an include dictionary: the path found in the search
+   path, or filename itself if it is not found, which ctemplate reports
+   when the include is expanded. */
+static std::string
+include_filename (const char* filename, size_t filename_len) {
+    std::string name(filename, filename_len);
+    std::string path;
+    if (!resolve_template(name, &path))
+        return name;
+    return path;
+}
+
+
 /*********************** Dictionary *************************/
+/* A TemplateDictionary cannot be enumerated, so for dictionaries created
+   with serializable=True every change made to the dictionary tree
+   through this module is also appended to a journal owned by the root
+   Dictionary. Dictionary.Serialize() returns the journal without the
+   records overwritten later, Dictionary.Deserialize() replays it.
+   Format: the magic "CTD1", the root dictionary name, then one record
+   per change: a record type byte, the id of the changed dictionary and
+   one or two strings. Numbers are varints, strings are length-prefixed.
+   The root dictionary has id 0, every AddSectionDictionary or
+   AddIncludeDictionary record creates the dictionary with the next id. */
+#define JOURNAL_MAGIC "CTD1"
+enum {
+    JOURNAL_VALUE = 'V',            /* name, value */
+    JOURNAL_SHOW_SECTION = 'S',     /* name */
+    JOURNAL_SECTION_DICT = 'D',     /* name */
+    JOURNAL_INCLUDE_DICT = 'I',     /* name */
+    JOURNAL_FILENAME = 'F',         /* filename */
+    JOURNAL_TEMPLATE_GLOBAL = 'G',  /* name, value */
+};
+
+/* state shared by a root dictionary and all its sub dictionaries */
+struct DictionaryTree {
+    // only used if journaling is true
+    std::string journal;
+    bool journaling;
+    // number of dictionary ids handed out so far
+    size_t num_dicts;
+    // number of dictionaries added by ShowSection(), which have no id
+    size_t num_shown;
+    // "id\nname" of each section with a dictionary, ShowSection() only
+    // adds one to a section without any
+    HASH_MAP<std::string, char> sections;
+    // number of calls setting a value and the size of the names and
+    // values passed, overwritten values are still counted
+    size_t num_values;
+    size_t value_bytes;
+    // number of running expansions, ExpandAsync() workers end theirs
+    // without the GIL, so it is only changed with atomic operations
+    int expanding;
+
+    DictionaryTree() : journaling(false), num_dicts(1), num_shown(0),
+                       num_values(0), value_bytes(0), expanding(0) {}
+
+    void AddValue(size_t name_len, size_t value_len) {
+        num_values++;
+        value_bytes += name_len + value_len;
+    }
+
+    /* Note that section name of dictionary id has a dictionary now.
+       Returns false if it had one before. */
+    bool AddSection(size_t id, const char* name, size_t name_len) {
+        char buf[32];
+        PyOS_snprintf(buf, sizeof(buf), "%lu\n", (unsigned long)id);
+        std::string key(buf);
+        key.append(name, name_len);
+        return sections.insert(std::make_pair(key, (char)0)).second;
+    }
+
+    void ShowSection(size_t id, const char* name, size_t name_len) {
+        if (AddSection(id, name, name_len))
+            num_shown++;
+    }
+
+    void BeginExpand() {
+        __sync_add_and_fetch(&expanding, 1);
+    }
+
+    void EndExpand() {
+        __sync_sub_and_fetch(&expanding, 1);
+    }
+
+    /* Returns false with RuntimeError set while a template expands the
+       tree. Expansions run without the GIL and read the ctemplate
+       dictionaries, so these must not change meanwhile. */
+    bool CheckNotExpanding() {
+        if (__sync_add_and_fetch(&expanding, 0) == 0)
+            return true;
+        PyErr_SetString(PyExc_RuntimeError, "dictionary changed while a "
+                        "template is expanded with it");
+        return false;
+    }
+};
+
+static void
+journal_varint (std::string* out, size_t n) {
+    while (n >= 0x80) {
+        out->push_back((char)(n | 0x80));
+        n >>= 7;
+    }
+    out->push_back((char)n);
+}
+
+static void
+journal_string (std::string* out, const char* s, size_t len) {
+    journal_varint(out, len);
+    out->append(s, len);
+}
+
+/* reads a journal from a buffer, checking all bounds */
+class JournalReader {
+    const unsigned char* pos;
+    const unsigned char* end;
+public:
+    JournalReader(const char* data, size_t len)
+        : pos((const unsigned char*)data),
+          end((const unsigned char*)data + len) {}
+
+    bool AtEnd() const {
+        return pos == end;
+    }
+
+    const char* Position() const {
+        return (const char*)pos;
+    }
+
+    bool ReadByte(char* c) {
+        if (pos == end)
+            return false;
+        *c = (char)*pos++;
+        return true;
+    }
+
+    bool ReadVarint(size_t* n) {
+        *n = 0;
+        for (unsigned int shift = 0; shift < sizeof(size_t) * 8; shift += 7) {
+            if (pos == end)
+                return false;
+            unsigned char c = *pos++;
+            *n |= (size_t)(c & 0x7f) << shift;
+            if (!(c & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    bool ReadString(const char** s, size_t* len) {
+        if (!ReadVarint(len) || *len > (size_t)(end - pos))
+            return false;
+        *s = (const char*)pos;
+        pos += *len;
+        return true;
+    }
+};
+
 /* Type definition */
 typedef struct {
     PyObject_HEAD
     ctemplate::TemplateDictionary* dict;
     // Subdirectories don't have to be deleted on dealloc.
     bool subdict;
+    // The journal, shared with and owned by the root dictionary.
+    DictionaryTree* tree;
+    // Id of this dictionary in the journal.
+    size_t id;
+    // Sub dictionaries keep a reference to their root dictionary,
+    // which owns their TemplateDictionary.
+    PyObject* root;
 } Dictionary_Object;
 
 
+/* append a record with one string to the dictionary journal */
+static void
+journal_record (DictionaryTree* tree, size_t id, char type,
+                const char* a, size_t alen) {
+    if (!tree->journaling)
+        return;
+    std::string* out = &tree->journal;
+    out->push_back(type);
+    journal_varint(out, id);
+    journal_string(out, a, alen);
+}
+
+/* append a record with two strings to the dictionary journal */
+static void
+journal_record (DictionaryTree* tree, size_t id, char type,
+                const char* a, size_t alen, const char* b, size_t blen) {
+    tree->AddValue(alen, blen);
+    if (!tree->journaling)
+        return;
+    journal_record(tree, id, type, a, alen);
+    journal_string(&tree->journal, b, blen);
+}
+
 /* create Dictionary object */
 static PyObject*
 Dictionary_New (PyTypeObject* type, PyObject* args, PyObject* kwds) {
@@ -100,29 +435,74 @@ Dictionary_New (PyTypeObject* type, PyObject* args, PyObject* kwds) {
     }
     self->dict = NULL;
     self->subdict = false;
+    self->tree = NULL;
+    self->id = 0;
+    self->root = NULL;
     return (PyObject*)self;
 }
 
 /* initialize Dictionary object */
 static int
-Dictionary_Init (Dictionary_Object* self, PyObject* args) {
+Dictionary_Init (Dictionary_Object* self, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {(char*)"name", (char*)"serializable", NULL};
     const char* name;
-    if (!PyArg_ParseTuple(args, "s", &name))
+    Py_ssize_t name_len;
+    PyObject* serializable = Py_False;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#|O", kwlist,
+                                     &name, &name_len, &serializable))
+        return -1;
+    int journaling;
+    if ((journaling = PyObject_IsTrue(serializable)) == -1)
         return -1;
-    self->dict = new ctemplate::TemplateDictionary(std::string(name));
+    if (self->dict != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Dictionary already initialized");
+        return -1;
+    }
+    self->dict = new ctemplate::TemplateDictionary(std::string(name,
+                                                               name_len));
+    self->tree = new DictionaryTree();
+    if (journaling) {
+        self->tree->journaling = true;
+        self->tree->journal.append(JOURNAL_MAGIC);
+        journal_string(&self->tree->journal, name, name_len);
+    }
     return 0;
 }
 
 /* dealloc Dictionary object */
 static void
 Dictionary_Dealloc (Dictionary_Object* self) {
-    if (!self->subdict && self->dict) {
+    if (self->subdict) {
+        Py_XDECREF(self->root);
+    }
+    else {
         delete self->dict;
-        self->dict = NULL;
+        delete self->tree;
     }
+    self->dict = NULL;
+    self->tree = NULL;
     self->ob_type->tp_free((PyObject*)self);
 }
 
+/* create the Python object for a new sub dictionary of self */
+static PyObject*
+Dictionary_NewSubdict (Dictionary_Object* self,
+                       ctemplate::TemplateDictionary* subdict) {
+    extern PyTypeObject Dictionary_Type;
+    PyTypeObject* type = &Dictionary_Type;
+    Dictionary_Object* dict;
+    if ( (dict = (Dictionary_Object*) type->tp_alloc(type, 0)) == NULL) {
+        return NULL;
+    }
+    dict->subdict = true;
+    dict->dict = subdict;
+    dict->tree = self->tree;
+    dict->id = self->tree->num_dicts++;
+    dict->root = self->subdict ? self->root : (PyObject*)self;
+    Py_INCREF(dict->root);
+    return (PyObject*)dict;
+}
+
 /* Dictionary.SetValue(name, value) -> None */
 static PyObject*
 Dictionary_SetValue (Dictionary_Object* self, PyObject* args) {
@@ -143,8 +523,14 @@ Dictionary_SetValue (Dictionary_Object* self, PyObject* args) {
         Py_DECREF(strvalue);
         return NULL;
     }
+    if (!self->tree->CheckNotExpanding()) {
+        Py_DECREF(strvalue);
+        return NULL;
+    }
     self->dict->SetValue(ctemplate::TemplateString(name),
                          ctemplate::TemplateString(cvalue));
+    journal_record(self->tree, self->id, JOURNAL_VALUE,
+                   name, strlen(name), cvalue, strlen(cvalue));
     // XXX When strvalue is garbage collected, the internal char buffer
     // is freed, which invalidates the TemplateString buffer.
     // But then the strvalue ref is never decremented.
@@ -158,7 +544,12 @@ Dictionary_ShowSection (Dictionary_Object* self, PyObject* args) {
     const char* name;
     if (!PyArg_ParseTuple(args, "s", &name))
         return NULL;
+    if (!self->tree->CheckNotExpanding())
+        return NULL;
     self->dict->ShowSection(ctemplate::TemplateString(name));
+    self->tree->ShowSection(self->id, name, strlen(name));
+    journal_record(self->tree, self->id, JOURNAL_SHOW_SECTION,
+                   name, strlen(name));
     Py_RETURN_NONE;
 }
 
@@ -183,9 +574,22 @@ Dictionary_SetValueAndShowSection (Dictionary_Object* self, PyObject* args) {
         Py_DECREF(strvalue);
         return NULL;
     }
+    if (!self->tree->CheckNotExpanding()) {
+        Py_DECREF(strvalue);
+        return NULL;
+    }
     self->dict->SetValueAndShowSection(ctemplate::TemplateString(name),
                                        ctemplate::TemplateString(cvalue),
                                        ctemplate::TemplateString(section));
+    // this adds a section dictionary iff the value is not empty
+    if (*cvalue) {
+        self->tree->AddSection(self->id, section, strlen(section));
+        size_t id = self->tree->num_dicts++;
+        journal_record(self->tree, self->id, JOURNAL_SECTION_DICT,
+                       section, strlen(section));
+        journal_record(self->tree, id, JOURNAL_VALUE, name, strlen(name),
+                       cvalue, strlen(cvalue));
+    }
     // XXX When strvalue is garbage collected, the internal char buffer
     // is freed, which invalidates the TemplateString buffer.
     // But then the strvalue ref is never decremented.
@@ -209,16 +613,16 @@ Dictionary_AddSectionDictionary (Dictionary_Object* self, PyObject* args) {
     const char* name;
     if (!PyArg_ParseTuple(args, "s", &name))
         return NULL;
-    extern PyTypeObject Dictionary_Type;
-    PyTypeObject* type = &Dictionary_Type;
-    Dictionary_Object* dict;
-    if ( (dict = (Dictionary_Object*) type->tp_alloc(type, 0)) == NULL) {
+    if (!self->tree->CheckNotExpanding())
         return NULL;
+    PyObject* dict = Dictionary_NewSubdict(self, self->dict->
+        AddSectionDictionary(ctemplate::TemplateString(name)));
+    if (dict != NULL) {
+        self->tree->AddSection(self->id, name, strlen(name));
+        journal_record(self->tree, self->id, JOURNAL_SECTION_DICT,
+                       name, strlen(name));
     }
-    dict->subdict = true;
-    dict->dict = self->dict->
-        AddSectionDictionary(ctemplate::TemplateString(name));
-    return (PyObject*)dict;
+    return dict;
 }
 
 /* Dictionary.AddIncludeDictionary(name) -> Dictionary */
@@ -227,16 +631,14 @@ Dictionary_AddIncludeDictionary (Dictionary_Object* self, PyObject* args) {
     const char* name;
     if (!PyArg_ParseTuple(args, "s", &name))
         return NULL;
-    extern PyTypeObject Dictionary_Type;
-    PyTypeObject* type = &Dictionary_Type;
-    Dictionary_Object* dict;
-    if ( (dict = (Dictionary_Object*) type->tp_alloc(type, 0)) == NULL) {
+    if (!self->tree->CheckNotExpanding())
         return NULL;
-    }
-    dict->subdict = true;
-    dict->dict = self->dict->
-        AddIncludeDictionary(ctemplate::TemplateString(name));
-    return (PyObject*)dict;
+    PyObject* dict = Dictionary_NewSubdict(self, self->dict->
+        AddIncludeDictionary(ctemplate::TemplateString(name)));
+    if (dict != NULL)
+        journal_record(self->tree, self->id, JOURNAL_INCLUDE_DICT,
+                       name, strlen(name));
+    return dict;
 }
 
 /* Dictionary.SetFilename(name) -> None */
@@ -246,7 +648,14 @@ Dictionary_SetFilename (Dictionary_Object* self, PyObject* args) {
     Py_ssize_t name_len;
     if (!PyArg_ParseTuple(args, "s#", &name, &name_len))
         return NULL;
-    self->dict->SetFilename(ctemplate::TemplateString(name, name_len));
+    if (!self->tree->CheckNotExpanding())
+        return NULL;
+    // SetFilename() copies the name into the dictionary arena
+    std::string path = include_filename(name, name_len);
+    self->dict->SetFilename(ctemplate::TemplateString(path));
+    // the name is recorded, it is resolved again when deserializing
+    journal_record(self->tree, self->id, JOURNAL_FILENAME,
+                   name, name_len);
     Py_RETURN_NONE;
 }
 
@@ -268,9 +677,15 @@ Dictionary_SetGlobalValue (Dictionary_Object* self, PyObject* args) {
         Py_DECREF(strvalue);
         return NULL;
     }
+    if (!self->tree->CheckNotExpanding()) {
+        Py_DECREF(strvalue);
+        return NULL;
+    }
     self->dict->
         SetTemplateGlobalValue(ctemplate::TemplateString(name),
                                ctemplate::TemplateString(cvalue));
+    journal_record(self->tree, self->id, JOURNAL_TEMPLATE_GLOBAL,
+                   name, strlen(name), cvalue, strlen(cvalue));
     // XXX When strvalue is garbage collected, the internal char buffer
     // is freed, which invalidates the TemplateString buffer.
     // But then the strvalue ref is never decremented.
@@ -278,6 +693,559 @@ Dictionary_SetGlobalValue (Dictionary_Object* self, PyObject* args) {
     Py_RETURN_NONE;
 }
 
+/* Set one cell of Dictionary.AddSectionRows() with the same rules as
+   Dictionary[name] = value. Returns false with an exception set on error. */
+static bool
+set_cell (Dictionary_Object* self, ctemplate::TemplateDictionary* dict,
+          size_t id, const std::string& name,
+          const ctemplate::TemplateString& key, PyObject* value) {
+    char buf[32];
+    char* cvalue;
+    Py_ssize_t cvalue_len;
+    PyObject* strvalue = NULL;
+    if (PyBool_Check(value)) {
+        if (!self->tree->CheckNotExpanding())
+            return false;
+        if (value == Py_True) {
+            dict->ShowSection(key);
+            journal_record(self->tree, id, JOURNAL_SHOW_SECTION,
+                           name.data(), name.length());
+        }
+        return true;
+    }
+    // fast paths for the common types, without a temporary object
+    if (PyString_Check(value)) {
+        cvalue = PyString_AS_STRING(value);
+        cvalue_len = PyString_GET_SIZE(value);
+    }
+    else if (PyInt_CheckExact(value)) {
+        cvalue = buf;
+        cvalue_len = PyOS_snprintf(buf, sizeof(buf), "%ld",
+                                   PyInt_AS_LONG(value));
+    }
+    else {
+        if ((strvalue = PyObject_Str(value)) == NULL)
+            return false;
+        if (PyString_AsStringAndSize(strvalue, &cvalue, &cvalue_len) == -1) {
+            Py_DECREF(strvalue);
+            return false;
+        }
+    }
+    // str() may have run Python code, and with it other threads
+    if (!self->tree->CheckNotExpanding()) {
+        Py_XDECREF(strvalue);
+        return false;
+    }
+    // SetValue() copies the value into the dictionary arena
+    dict->SetValue(key, ctemplate::TemplateString(cvalue, cvalue_len));
+    journal_record(self->tree, id, JOURNAL_VALUE, name.data(), name.length(),
+                   cvalue, cvalue_len);
+    Py_XDECREF(strvalue);
+    return true;
+}
+
+/* One column of Dictionary.AddSectionRows(): a sequence, or a buffer of
+   numbers with a struct module format (numpy arrays, array.array).
+   Buffers of other items (strings, objects) are read as a sequence. */
+class RowColumn {
+    PyObject* seq;
+    Py_buffer view;
+    bool has_view;
+    const char* data;
+    char format;
+    Py_ssize_t itemsize;
+public:
+    Py_ssize_t length;
+
+    RowColumn() : seq(NULL), has_view(false), data(NULL), format(0),
+                  itemsize(0), length(0) {}
+
+    ~RowColumn() {
+        Py_XDECREF(seq);
+        if (has_view)
+            PyBuffer_Release(&view);
+    }
+
+    /* Returns false with an exception set on error. */
+    bool Init(PyObject* obj) {
+        if (PyString_Check(obj) || PyUnicode_Check(obj)) {
+            PyErr_SetString(PyExc_TypeError, "column must be a sequence "
+                            "or buffer, not a string");
+            return false;
+        }
+        if (PyObject_CheckBuffer(obj)) {
+            // non-contiguous buffers are read as a sequence
+            if (PyObject_GetBuffer(obj, &view, PyBUF_FORMAT |
+                                   PyBUF_C_CONTIGUOUS) == 0) {
+                has_view = true;
+                if (view.ndim > 1) {
+                    PyErr_SetString(PyExc_ValueError,
+                                    "column buffer must be one-dimensional");
+                    return false;
+                }
+                const char* fmt = view.format ? view.format : "B";
+                if (*fmt == '@' || *fmt == '=')
+                    fmt++;
+                if (strlen(fmt) == 1 && FormatSize(*fmt) == view.itemsize) {
+                    SetFormat(*fmt, (const char*)view.buf, view.len,
+                              view.itemsize);
+                    return true;
+                }
+                PyBuffer_Release(&view);
+                has_view = false;
+            }
+            PyErr_Clear();
+        }
+        // array.array only has the old buffer interface in Python 2
+        else {
+            PyObject* typecode = PyObject_GetAttrString(obj, "typecode");
+            PyObject* size = PyObject_GetAttrString(obj, "itemsize");
+            const void* buf;
+            Py_ssize_t buflen;
+            bool ok = typecode != NULL && size != NULL &&
+                PyString_Check(typecode) &&
+                PyString_GET_SIZE(typecode) == 1 && PyInt_Check(size) &&
+                FormatSize(PyString_AS_STRING(typecode)[0]) ==
+                PyInt_AS_LONG(size) &&
+                PyObject_AsReadBuffer(obj, &buf, &buflen) == 0;
+            if (ok) {
+                SetFormat(PyString_AS_STRING(typecode)[0], (const char*)buf,
+                          buflen, PyInt_AS_LONG(size));
+                // keep the array alive, the buffer is used until we are done
+                Py_INCREF(obj);
+                seq = obj;
+            }
+            Py_XDECREF(typecode);
+            Py_XDECREF(size);
+            if (ok)
+                return true;
+            PyErr_Clear();
+        }
+        if ((seq = PySequence_Fast(obj, "column must be a sequence")) == NULL)
+            return false;
+        length = PySequence_Fast_GET_SIZE(seq);
+        return true;
+    }
+
+    /* Returns the item size of a supported format, 0 for others. */
+    static Py_ssize_t FormatSize(char fmt) {
+        switch (fmt) {
+        case 'b': case 'B': case 'c': case '?': return 1;
+        case 'h': case 'H': return sizeof(short);
+        case 'i': case 'I': return sizeof(int);
+        case 'l': case 'L': return sizeof(long);
+        case 'q': case 'Q': return sizeof(PY_LONG_LONG);
+        case 'f': return sizeof(float);
+        case 'd': return sizeof(double);
+        default: return 0;
+        }
+    }
+
+    void SetFormat(char fmt, const char* buf, Py_ssize_t buflen,
+                   Py_ssize_t size) {
+        format = fmt;
+        itemsize = size;
+        data = buf;
+        length = buflen / size;
+    }
+
+    /* Set row i of this column as key in dict. */
+    bool SetCell(Dictionary_Object* self, ctemplate::TemplateDictionary* dict,
+                 size_t id, const std::string& name,
+                 const ctemplate::TemplateString& key, Py_ssize_t i) {
+        if (data == NULL)
+            return set_cell(self, dict, id, name, key,
+                            PySequence_Fast_GET_ITEM(seq, i));
+        if (!self->tree->CheckNotExpanding())
+            return false;
+        const char* p = data + i * itemsize;
+        char buf[64];
+        int len;
+        char* dbl = NULL;
+        switch (format) {
+#define ROWCOLUMN_FORMAT(code, type, pyfmt, cast)                   \
+        case code: {                                            \
+            type v;                                             \
+            memcpy(&v, p, sizeof(v));                           \
+            len = PyOS_snprintf(buf, sizeof(buf), pyfmt, (cast)v); \
+            break;                                              \
+        }
+        ROWCOLUMN_FORMAT('b', signed char, "%d", int)
+        ROWCOLUMN_FORMAT('B', unsigned char, "%u", unsigned int)
+        ROWCOLUMN_FORMAT('h', short, "%d", int)
+        ROWCOLUMN_FORMAT('H', unsigned short, "%u", unsigned int)
+        ROWCOLUMN_FORMAT('i', int, "%d", int)
+        ROWCOLUMN_FORMAT('I', unsigned int, "%u", unsigned int)
+        ROWCOLUMN_FORMAT('l', long, "%ld", long)
+        ROWCOLUMN_FORMAT('L', unsigned long, "%lu", unsigned long)
+        ROWCOLUMN_FORMAT('q', PY_LONG_LONG, "%lld", PY_LONG_LONG)
+        ROWCOLUMN_FORMAT('Q', unsigned PY_LONG_LONG, "%llu",
+                         unsigned PY_LONG_LONG)
+#undef ROWCOLUMN_FORMAT
+        case 'c':
+            buf[0] = *p;
+            len = 1;
+            break;
+        case '?':
+            // like Python booleans: true shows the section
+            if (*p) {
+                dict->ShowSection(key);
+                journal_record(self->tree, id, JOURNAL_SHOW_SECTION,
+                               name.data(), name.length());
+            }
+            return true;
+        default: {
+            // same formatting as str(float)
+            double v;
+            if (format == 'f') {
+                float f;
+                memcpy(&f, p, sizeof(f));
+                v = f;
+            }
+            else {
+                memcpy(&v, p, sizeof(v));
+            }
+            if ((dbl = PyOS_double_to_string(v, 'g', PyFloat_STR_PRECISION,
+                                             Py_DTSF_ADD_DOT_0, NULL))
+                == NULL)
+                return false;
+            len = strlen(dbl);
+        }
+        }
+        const char* cvalue = dbl ? dbl : buf;
+        dict->SetValue(key, ctemplate::TemplateString(cvalue, len));
+        journal_record(self->tree, id, JOURNAL_VALUE,
+                       name.data(), name.length(), cvalue, len);
+        if (dbl)
+            PyMem_Free(dbl);
+        return true;
+    }
+};
+
+/* Dictionary.AddSectionRows(section, columns, data[, bycolumn]) -> int */
+static PyObject*
+Dictionary_AddSectionRows (Dictionary_Object* self, PyObject* args) {
+    const char* section;
+    PyObject* columns;
+    PyObject* data;
+    PyObject* bycolumn_obj = Py_False;
+    if (!PyArg_ParseTuple(args, "sOO|O", &section, &columns, &data,
+                          &bycolumn_obj))
+        return NULL;
+    int bycolumn;
+    if ((bycolumn = PyObject_IsTrue(bycolumn_obj)) == -1)
+        return NULL;
+    // resolve the column keys once
+    PyObject* seq;
+    if ((seq = PySequence_Fast(columns, "columns must be a sequence"))
+        == NULL)
+        return NULL;
+    Py_ssize_t ncolumns = PySequence_Fast_GET_SIZE(seq);
+    std::vector<std::string> names(ncolumns);
+    for (Py_ssize_t i = 0; i < ncolumns; i++) {
+        char* name;
+        Py_ssize_t name_len;
+        if (PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(seq, i),
+                                     &name, &name_len) == -1) {
+            Py_DECREF(seq);
+            return NULL;
+        }
+        names[i].assign(name, name_len);
+    }
+    Py_DECREF(seq);
+    std::vector<ctemplate::TemplateString> keys;
+    for (Py_ssize_t i = 0; i < ncolumns; i++)
+        keys.push_back(ctemplate::TemplateString(names[i].data(),
+                                                 names[i].length()));
+    ctemplate::TemplateString section_key(section);
+    size_t section_len = strlen(section);
+    Py_ssize_t nrows = 0;
+
+    if (bycolumn) {
+        if ((seq = PySequence_Fast(data, "data must be a sequence of "
+                                   "columns")) == NULL)
+            return NULL;
+        if (PySequence_Fast_GET_SIZE(seq) != ncolumns) {
+            Py_DECREF(seq);
+            PyErr_Format(PyExc_ValueError, "expected %zd columns, got %zd",
+                         ncolumns, PySequence_Fast_GET_SIZE(seq));
+            return NULL;
+        }
+        // RowColumn is only copied here while still empty
+        std::vector<RowColumn> cols(ncolumns);
+        for (Py_ssize_t i = 0; i < ncolumns; i++) {
+            if (!cols[i].Init(PySequence_Fast_GET_ITEM(seq, i))) {
+                Py_DECREF(seq);
+                return NULL;
+            }
+            if (cols[i].length != cols[0].length) {
+                Py_DECREF(seq);
+                PyErr_SetString(PyExc_ValueError,
+                                "columns must have the same length");
+                return NULL;
+            }
+        }
+        nrows = ncolumns ? cols[0].length : 0;
+        if (nrows > 0)
+            self->tree->AddSection(self->id, section, section_len);
+        for (Py_ssize_t row = 0; row < nrows; row++) {
+            if (!self->tree->CheckNotExpanding()) {
+                Py_DECREF(seq);
+                return NULL;
+            }
+            ctemplate::TemplateDictionary* dict =
+                self->dict->AddSectionDictionary(section_key);
+            size_t id = self->tree->num_dicts++;
+            journal_record(self->tree, self->id, JOURNAL_SECTION_DICT,
+                           section, section_len);
+            for (Py_ssize_t i = 0; i < ncolumns; i++) {
+                if (!cols[i].SetCell(self, dict, id, names[i], keys[i],
+                                     row)) {
+                    Py_DECREF(seq);
+                    return NULL;
+                }
+            }
+        }
+        Py_DECREF(seq);
+        return PyInt_FromSsize_t(nrows);
+    }
+
+    PyObject* iter;
+    if ((iter = PyObject_GetIter(data)) == NULL)
+        return NULL;
+    PyObject* row;
+    while ((row = PyIter_Next(iter)) != NULL) {
+        PyObject* cells = PySequence_Fast(row, "row must be a sequence");
+        Py_DECREF(row);
+        if (cells == NULL)
+            break;
+        if (PySequence_Fast_GET_SIZE(cells) != ncolumns) {
+            PyErr_Format(PyExc_ValueError, "row %zd has %zd values, "
+                         "expected %zd", nrows,
+                         PySequence_Fast_GET_SIZE(cells), ncolumns);
+            Py_DECREF(cells);
+            break;
+        }
+        if (!self->tree->CheckNotExpanding()) {
+            Py_DECREF(cells);
+            break;
+        }
+        if (nrows == 0)
+            self->tree->AddSection(self->id, section, section_len);
+        ctemplate::TemplateDictionary* dict =
+            self->dict->AddSectionDictionary(section_key);
+        size_t id = self->tree->num_dicts++;
+        journal_record(self->tree, self->id, JOURNAL_SECTION_DICT,
+                       section, section_len);
+        bool ok = true;
+        for (Py_ssize_t i = 0; ok && i < ncolumns; i++)
+            ok = set_cell(self, dict, id, names[i], keys[i],
+                          PySequence_Fast_GET_ITEM(cells, i));
+        Py_DECREF(cells);
+        if (!ok)
+            break;
+        nrows++;
+    }
+    Py_DECREF(iter);
+    if (PyErr_Occurred())
+        return NULL;
+    return PyInt_FromSsize_t(nrows);
+}
+
+/* Remove the records without effect from a journal: values and
+   template-global values set again with the same name in the same
+   dictionary, all but the last SetFilename of a dictionary and repeated
+   ShowSection calls. Only the first ShowSection of a section counts, it
+   adds an empty section dictionary if there is none yet, so that one is
+   kept in its place. */
+static void
+compact_journal (std::string* journal) {
+    const char* data = journal->data();
+    size_t header_len = strlen(JOURNAL_MAGIC);
+    JournalReader reader(data + header_len, journal->length() - header_len);
+    const char* name;
+    size_t name_len;
+    if (!reader.ReadString(&name, &name_len))
+        return;
+    header_len = reader.Position() - data;
+    // start of each record, plus the end of the last one
+    std::vector<size_t> starts;
+    // what each record sets, empty for records that are always kept
+    std::vector<std::string> keys;
+    // key -> index of the record kept for that key
+    HASH_MAP<std::string, size_t> kept;
+    while (!reader.AtEnd()) {
+        const char* start = reader.Position();
+        char type;
+        size_t id;
+        const char* value;
+        size_t value_len;
+        if (!reader.ReadByte(&type) || !reader.ReadVarint(&id))
+            return;
+        const char* key_end = reader.Position();
+        if (!reader.ReadString(&name, &name_len))
+            return;
+        if (type != JOURNAL_FILENAME)
+            key_end = reader.Position();
+        if (type == JOURNAL_VALUE || type == JOURNAL_TEMPLATE_GLOBAL) {
+            if (!reader.ReadString(&value, &value_len))
+                return;
+        }
+        starts.push_back(start - data);
+        if (type == JOURNAL_SECTION_DICT || type == JOURNAL_INCLUDE_DICT) {
+            keys.push_back(std::string());
+        }
+        else {
+            keys.push_back(std::string(start, key_end - start));
+            if (type == JOURNAL_SHOW_SECTION)
+                kept.insert(std::make_pair(keys.back(), keys.size() - 1));
+            else
+                kept[keys.back()] = keys.size() - 1;
+        }
+    }
+    starts.push_back(journal->length());
+    std::string out(*journal, 0, header_len);
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i].empty() || kept[keys[i]] == i)
+            out.append(*journal, starts[i], starts[i + 1] - starts[i]);
+    }
+    journal->swap(out);
+}
+
+/* Dictionary.Serialize() -> String */
+static PyObject*
+Dictionary_Serialize (Dictionary_Object* self, PyObject* args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+    if (self->subdict) {
+        PyErr_SetString(PyExc_ValueError,
+                        "only root dictionaries can be serialized");
+        return NULL;
+    }
+    if (!self->tree->journaling) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Dictionary was not created with serializable=True");
+        return NULL;
+    }
+    compact_journal(&self->tree->journal);
+    return PyString_FromStringAndSize(self->tree->journal.data(),
+                                      self->tree->journal.length());
+}
+
+/* replay a serialized journal into a new TemplateDictionary, returns
+   NULL when the data is corrupt */
+static ctemplate::TemplateDictionary*
+replay_journal (const char* data, size_t len, DictionaryTree* tree) {
+    const char* name;
+    size_t name_len;
+    size_t magic_len = strlen(JOURNAL_MAGIC);
+    if (len < magic_len || memcmp(data, JOURNAL_MAGIC, magic_len) != 0)
+        return NULL;
+    JournalReader reader(data + magic_len, len - magic_len);
+    if (!reader.ReadString(&name, &name_len))
+        return NULL;
+    ctemplate::TemplateDictionary* root =
+        new ctemplate::TemplateDictionary(std::string(name, name_len));
+    std::vector<ctemplate::TemplateDictionary*> dicts;
+    dicts.push_back(root);
+    while (!reader.AtEnd()) {
+        char type;
+        size_t id;
+        const char* value;
+        size_t value_len;
+        if (!reader.ReadByte(&type) || !reader.ReadVarint(&id) ||
+            id >= dicts.size() || !reader.ReadString(&name, &name_len))
+            goto corrupt;
+        ctemplate::TemplateDictionary* dict = dicts[id];
+        ctemplate::TemplateString tname(name, name_len);
+        switch (type) {
+        case JOURNAL_VALUE:
+            if (!reader.ReadString(&value, &value_len))
+                goto corrupt;
+            dict->SetValue(tname, ctemplate::TemplateString(value,
+                                                            value_len));
+            tree->AddValue(name_len, value_len);
+            break;
+        case JOURNAL_SHOW_SECTION:
+            dict->ShowSection(tname);
+            tree->ShowSection(id, name, name_len);
+            break;
+        case JOURNAL_SECTION_DICT:
+            dicts.push_back(dict->AddSectionDictionary(tname));
+            tree->AddSection(id, name, name_len);
+            break;
+        case JOURNAL_INCLUDE_DICT:
+            dicts.push_back(dict->AddIncludeDictionary(tname));
+            break;
+        case JOURNAL_FILENAME:
+            dict->SetFilename(include_filename(name, name_len));
+            break;
+        case JOURNAL_TEMPLATE_GLOBAL:
+            if (!reader.ReadString(&value, &value_len))
+                goto corrupt;
+            dict->SetTemplateGlobalValue(tname,
+                ctemplate::TemplateString(value, value_len));
+            tree->AddValue(name_len, value_len);
+            break;
+        default:
+            goto corrupt;
+        }
+    }
+    tree->num_dicts = dicts.size();
+    return root;
+corrupt:
+    delete root;
+    return NULL;
+}
+
+/* Dictionary.Deserialize(data) -> Dictionary */
+static PyObject*
+Dictionary_Deserialize (PyTypeObject* type, PyObject* args) {
+    const char* data;
+    Py_ssize_t data_len;
+    if (!PyArg_ParseTuple(args, "s#", &data, &data_len))
+        return NULL;
+    DictionaryTree* tree = new DictionaryTree();
+    ctemplate::TemplateDictionary* dict = replay_journal(data, data_len,
+                                                         tree);
+    if (dict == NULL) {
+        delete tree;
+        PyErr_SetString(PyExc_ValueError, "invalid serialized dictionary");
+        return NULL;
+    }
+    Dictionary_Object* self;
+    if ((self = (Dictionary_Object*) Dictionary_New(type, NULL, NULL))
+        == NULL) {
+        delete dict;
+        delete tree;
+        return NULL;
+    }
+    self->dict = dict;
+    self->tree = tree;
+    self->tree->journaling = true;
+    self->tree->journal.assign(data, data_len);
+    return (PyObject*)self;
+}
+
+/* Dictionary.MemoryUsage() -> dict
+   TemplateDictionary accepts an UnsafeArena, but that class is not in
+   the installed ctemplate headers, so the arena can neither be sized
+   nor measured and only what this module knows is reported. Values are
+   counted per set call, tracking distinct names would cost a set of
+   all names. */
+static PyObject*
+Dictionary_MemoryUsage (Dictionary_Object* self, PyObject* args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+    DictionaryTree* tree = self->tree;
+    return Py_BuildValue("{s:n,s:n,s:n,s:n}",
+                         "dictionaries",
+                         (Py_ssize_t)(tree->num_dicts + tree->num_shown),
+                         "set_calls", (Py_ssize_t)tree->num_values,
+                         "set_bytes", (Py_ssize_t)tree->value_bytes,
+                         "journal_bytes", (Py_ssize_t)tree->journal.capacity());
+}
+
 static PyMethodDef Dictionary_Methods[] = {
     {"SetValue", (PyCFunction)Dictionary_SetValue, METH_VARARGS,
      "Set variable value."},
@@ -293,13 +1261,37 @@ static PyMethodDef Dictionary_Methods[] = {
     {"AddIncludeDictionary", (PyCFunction)Dictionary_AddIncludeDictionary,
      METH_VARARGS, "Add include dictionary."},
     {"SetFilename", (PyCFunction)Dictionary_SetFilename, METH_VARARGS,
-     "Set filename."},
+     "Set filename. Relative names are looked up in the template\n"
+     "search path."},
     {"SetGlobalValue", (PyCFunction)Dictionary_SetGlobalValue, METH_VARARGS,
      "This is used for a value that you want to be 'global', but only\n"
      "in the scope of a given template, including all its sections and\n"
      "all its sub-included dictionaries.  The main difference between\n"
      "SetGlobalValue() and SetValue(), is that SetGlobalValue()\n"
      "values persist across template-includes."},
+    {"AddSectionRows", (PyCFunction)Dictionary_AddSectionRows, METH_VARARGS,
+     "AddSectionRows(section, columns, data[, bycolumn])\n"
+     "Add one section dictionary per row and set the values named by\n"
+     "columns in it, as if done with AddSectionDictionary() and\n"
+     "dict[name] = value. data is an iterable of row tuples or, if\n"
+     "bycolumn is true, a sequence with one sequence or number buffer\n"
+     "(numpy array, array.array) per column. Returns the number of rows."},
+    {"Serialize", (PyCFunction)Dictionary_Serialize, METH_VARARGS,
+     "Serialize the dictionary and all its section and include\n"
+     "dictionaries into a compact binary string, which can be read\n"
+     "back with Dictionary.Deserialize(). Only dictionaries created\n"
+     "with Dictionary(name, serializable=True) can be serialized."},
+    {"Deserialize", (PyCFunction)Dictionary_Deserialize,
+     METH_VARARGS | METH_CLASS,
+     "Create a new Dictionary from a string returned by Serialize()."},
+    {"MemoryUsage", (PyCFunction)Dictionary_MemoryUsage, METH_VARARGS,
+     "Return a dict describing the whole dictionary tree this dictionary\n"
+     "belongs to: the number of dictionaries (including section and\n"
+     "include dictionaries and those added by ShowSection()), the number\n"
+     "of calls setting a value (set_calls, overwrites included), the bytes\n"
+     "of the names and values passed to them (set_bytes), and the bytes\n"
+     "allocated for the serialization journal. The memory used by the\n"
+     "ctemplate library itself is not accessible and not included."},
     {NULL} /* Sentinel */
 };
 
@@ -324,50 +1316,580 @@ dict_ass_sub(Dictionary_Object* self, PyObject *name, PyObject *value) {
             Py_DECREF(value);
             return -1;
         }
+        if (res && !self->tree->CheckNotExpanding()) {
+            Py_DECREF(value);
+            return -1;
+        }
         if (res) {
             self->dict->ShowSection(ctemplate::TemplateString(cname));
+            journal_record(self->tree, self->id, JOURNAL_SHOW_SECTION,
+                           cname, strlen(cname));
+        }
+    }
+    else
+    {
+        char* cvalue;
+        PyObject* strvalue;
+        if ((strvalue = PyObject_Str(value)) == NULL) {
+            Py_DECREF(value);
+            return -1;
+        }
+        if ((cvalue = PyString_AsString(strvalue)) == NULL) {
+            Py_DECREF(value);
+            Py_DECREF(strvalue);
+            return -1;
+        }
+        if (!self->tree->CheckNotExpanding()) {
+            Py_DECREF(value);
+            Py_DECREF(strvalue);
+            return -1;
+        }
+        self->dict->SetValue(ctemplate::TemplateString(cname),
+                             ctemplate::TemplateString(cvalue));
+        journal_record(self->tree, self->id, JOURNAL_VALUE,
+                       cname, strlen(cname), cvalue, strlen(cvalue));
+    }
+    Py_DECREF(value);
+    // XXX When strvalue is garbage collected, the internal char buffer
+    // is freed, which invalidates the TemplateString buffer.
+    // But then the strvalue ref is never decremented.
+    // Py_DECREF(strvalue);
+    return 0;
+}
+
+static PyMappingMethods dict_as_mapping = {
+    0, /* mp_length */
+    0, /* mp_subscript */
+    (objobjargproc)dict_ass_sub, /* mp_ass_subscript */
+};
+
+// It cannot be static because we have declared it as 'extern' before.
+// This would cause a linker error.
+PyTypeObject Dictionary_Type = {
+    PyObject_HEAD_INIT(NULL)
+    0,              /* ob_size */
+    "ctemplate.Dictionary",             /* tp_name */
+    sizeof(Dictionary_Object), /* tp_size */
+    0,              /* tp_itemsize */
+    /* methods */
+    (destructor)Dictionary_Dealloc, /* tp_dealloc */
+    0,              /* tp_print */
+    0,              /* tp_getattr */
+    0,              /* tp_setattr */
+    0,              /* tp_compare */
+    0,              /* tp_repr */
+    0,              /* tp_as_number */
+    0,              /* tp_as_sequence */
+    &dict_as_mapping, /* tp_as_mapping */
+    0,              /* tp_hash */
+    0,              /* tp_call */
+    0,              /* tp_str */
+    0,              /* tp_getattro */
+    0,              /* tp_setattro */
+    0,              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT, /* tp_flags */
+    "maps names (as found in template files) to their values.\n"
+    "There are three types of names:\n"
+    "  variables: value is a string.\n"
+    "  sections: value is a list of sub-dicts to use when expanding\n"
+    "    the section; the section is expanded once per sub-dict.\n"
+    "  template-include: value is a list of pairs: name of the template\n"
+    "    file to include, and the sub-dict to use when expanding it.\n"
+    "The object has routines for setting these values.\n"
+    "Dictionary(name[, serializable]): if serializable is true, changes\n"
+    "are recorded for Serialize().", /* tp_doc */
+    0,              /* tp_traverse */
+    0,              /* tp_clear */
+    0,              /* tp_richcompare */
+    0,              /* tp_weaklistoffset */
+    0,              /* tp_iter */
+    0,              /* tp_iternext */
+    Dictionary_Methods, /* tp_methods */
+    0,              /* tp_members */
+    0,              /* tp_getset */
+    0,              /* tp_base */
+    0,              /* tp_dict */
+    0,              /* tp_descr_get */
+    0,              /* tp_descr_set */
+    0,              /* tp_dictoffset */
+    (initproc)Dictionary_Init,  /* tp_init */
+    0,              /* tp_alloc */
+    Dictionary_New, /* tp_new */
+    0,              /* tp_free */
+    0,              /* tp_is_gc */
+    0,              /* tp_bases */
+    0,              /* tp_mro */
+    0,              /* tp_cache */
+    0,              /* tp_subclasses */
+    0,              /* tp_weaklist */
+    0,              /* tp_del */
+};
+
+
+/************************** ExpandResult ****************************/
+/* Owns the std::string filled by Template.ExpandToBuffer() and exposes
+   it through the buffer interface, so the expanded text is never copied
+   into a separate Python string. */
+typedef struct {
+    PyObject_HEAD
+    std::string* output;
+} ExpandResult_Object;
+
+
+/* dealloc ExpandResult object */
+static void
+ExpandResult_Dealloc (ExpandResult_Object* self) {
+    delete self->output;
+    self->output = NULL;
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+/* len(ExpandResult) -> int */
+static Py_ssize_t
+ExpandResult_Length (ExpandResult_Object* self) {
+    return self->output->length();
+}
+
+/* str(ExpandResult) -> String (this copies) */
+static PyObject*
+ExpandResult_Str (ExpandResult_Object* self) {
+    return PyString_FromStringAndSize(self->output->data(),
+                                      self->output->length());
+}
+
+/* old style buffer interface: one read-only segment */
+static Py_ssize_t
+ExpandResult_GetReadBuffer (ExpandResult_Object* self, Py_ssize_t segment,
+                            void** ptr) {
+    if (segment != 0) {
+        PyErr_SetString(PyExc_SystemError,
+                        "accessing non-existent ExpandResult segment");
+        return -1;
+    }
+    *ptr = (void*)self->output->data();
+    return self->output->length();
+}
+
+static Py_ssize_t
+ExpandResult_GetSegCount (ExpandResult_Object* self, Py_ssize_t* lenp) {
+    if (lenp)
+        *lenp = self->output->length();
+    return 1;
+}
+
+/* new style buffer interface, used by memoryview() and bytearray() */
+static int
+ExpandResult_GetBuffer (ExpandResult_Object* self, Py_buffer* view,
+                        int flags) {
+    return PyBuffer_FillInfo(view, (PyObject*)self,
+                             (void*)self->output->data(),
+                             self->output->length(), 1, flags);
+}
+
+static PySequenceMethods ExpandResult_as_sequence = {
+    (lenfunc)ExpandResult_Length, /* sq_length */
+};
+
+static PyBufferProcs ExpandResult_as_buffer = {
+    (readbufferproc)ExpandResult_GetReadBuffer, /* bf_getreadbuffer */
+    0,              /* bf_getwritebuffer */
+    (segcountproc)ExpandResult_GetSegCount, /* bf_getsegcount */
+    (charbufferproc)ExpandResult_GetReadBuffer, /* bf_getcharbuffer */
+    (getbufferproc)ExpandResult_GetBuffer, /* bf_getbuffer */
+    0,              /* bf_releasebuffer */
+};
+
+static PyTypeObject ExpandResult_Type = {
+    PyObject_HEAD_INIT(NULL)
+    0,              /* ob_size */
+    "ctemplate.ExpandResult",             /* tp_name */
+    sizeof(ExpandResult_Object), /* tp_size */
+    0,              /* tp_itemsize */
+    /* methods */
+    (destructor)ExpandResult_Dealloc, /* tp_dealloc */
+    0,              /* tp_print */
+    0,              /* tp_getattr */
+    0,              /* tp_setattr */
+    0,              /* tp_compare */
+    0,              /* tp_repr */
+    0,              /* tp_as_number */
+    &ExpandResult_as_sequence, /* tp_as_sequence */
+    0,              /* tp_as_mapping */
+    0,              /* tp_hash */
+    0,              /* tp_call */
+    (reprfunc)ExpandResult_Str, /* tp_str */
+    0,              /* tp_getattro */
+    0,              /* tp_setattro */
+    &ExpandResult_as_buffer, /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+    "Read-only buffer holding the output of Template.ExpandToBuffer().\n"
+    "Use memoryview() or the buffer interface to access the data without\n"
+    "copying it; str() returns a copy.", /* tp_doc */
+};
+
+
+/* ExpandEmitter writing into a fixed size buffer. Output not fitting
+   into the buffer is dropped but counted in needed. */
+class FixedBufferEmitter : public ctemplate::ExpandEmitter {
+    char* buf;
+    Py_ssize_t buflen;
+public:
+    Py_ssize_t needed;
+
+    FixedBufferEmitter(char* buf, Py_ssize_t buflen) : buf(buf),
+        buflen(buflen), needed(0) {}
+
+    virtual void Emit(char c) {
+        Emit(&c, 1);
+    }
+
+    virtual void Emit(const std::string& s) {
+        Emit(s.data(), s.length());
+    }
+
+    virtual void Emit(const char* s) {
+        Emit(s, strlen(s));
+    }
+
+    virtual void Emit(const char* s, size_t slen) {
+        if (needed + (Py_ssize_t)slen <= buflen)
+            memcpy(buf + needed, s, slen);
+        needed += slen;
+    }
+};
+
+
+/************************** ExpandFuture ****************************/
+/* Template.ExpandAsync() queues an ExpandJob for a pool of native worker
+   threads, which expand templates without holding the GIL. All jobs
+   share one completion descriptor, an eventfd (a pipe on other systems)
+   counting finished jobs, so an event loop watches a single descriptor
+   and collects the finished futures with ctemplate.CollectExpanded(). */
+class ExpandJob {
+public:
+    const ctemplate::Template* tpl;
+    DictionaryTree* tree;
+    const ctemplate::TemplateDictionary* dict;
+    std::string output;
+    // protected by pool_lock
+    bool done;
+    // the worker running the job did not exist in a forked child
+    bool lost;
+    // the future, referenced until CollectExpanded() returns it; NULL if
+    // the completion descriptor was not in use when the job was queued
+    PyObject* future;
+    // clock around the expansion, see timing_add()
+    double start;
+    double end;
+
+    ExpandJob(const ctemplate::Template* tpl, DictionaryTree* tree,
+              const ctemplate::TemplateDictionary* dict)
+        : tpl(tpl), tree(tree), dict(dict), done(false), lost(false),
+          future(NULL), start(0), end(0) {}
+
+    /* called by the worker thread */
+    void Run() {
+        start = timing_now();
+        CTEMPLATE_PROBE1(expand__start, tpl->template_file());
+        tpl->Expand(&output, dict);
+        CTEMPLATE_PROBE2(expand__done, tpl->template_file(),
+                         output.length());
+        end = timing_now();
+    }
+
+    /* called with pool_lock held */
+    void Finish() {
+        // before done is set, so the dictionary can be changed as soon as
+        // the future is done
+        tree->EndExpand();
+        done = true;
+    }
+};
+
+// the worker pool, all protected by pool_lock
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+// signalled when a job is done
+static pthread_cond_t pool_done_cond = PTHREAD_COND_INITIALIZER;
+static std::deque<ExpandJob*> pool_queue;
+// jobs taken from the queue by a worker and not done yet
+static std::vector<ExpandJob*> pool_running;
+// done jobs with a future, until CollectExpanded() returns them
+static std::deque<ExpandJob*> pool_completed;
+// read and write end of the completion descriptor, -1 until the first
+// ctemplate.GetExpandFd(); set with the GIL held
+static int pool_fds[2] = {-1, -1};
+// number of running worker threads
+static int pool_threads = 0;
+// number of worker threads wanted, see ctemplate.SetExpandThreads()
+static int pool_size = 4;
+// set at interpreter exit, the workers finish the queue and exit
+static bool pool_closing = false;
+
+/* count one completion on the completion descriptor */
+static void
+pool_notify (void) {
+#ifdef __linux__
+    uint64_t one = 1;
+    while (write(pool_fds[1], &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+#else
+    // a full pipe is readable, which is all that matters
+    while (write(pool_fds[1], "x", 1) == -1 && errno == EINTR)
+        ;
+#endif
+}
+
+/* reset the completion descriptor to not readable */
+static void
+pool_drain (void) {
+    char buf[256];
+#ifdef __linux__
+    while (read(pool_fds[0], buf, sizeof(uint64_t)) == -1 && errno == EINTR)
+        ;
+#else
+    while (read(pool_fds[0], buf, sizeof(buf)) > 0 || errno == EINTR)
+        ;
+#endif
+}
+
+/* create the completion descriptor, sets errno on failure */
+static bool
+pool_open_fds (int* fds) {
+#ifdef __linux__
+    fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return fds[0] != -1;
+#else
+    if (pipe(fds) == -1)
+        return false;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#endif
+}
+
+/* block until job is done, call without the GIL */
+static void
+pool_wait (ExpandJob* job) {
+    pthread_mutex_lock(&pool_lock);
+    while (!job->done)
+        pthread_cond_wait(&pool_done_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static bool
+pool_done (ExpandJob* job) {
+    pthread_mutex_lock(&pool_lock);
+    bool result = job->done;
+    pthread_mutex_unlock(&pool_lock);
+    return result;
+}
+
+static void*
+expand_worker (void* arg) {
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (pool_queue.empty() && pool_threads <= pool_size &&
+               !pool_closing)
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        // the pool was shrunk
+        if (pool_threads > pool_size && !pool_closing)
+            break;
+        // the pool is closing and all jobs are done
+        if (pool_queue.empty())
+            break;
+        ExpandJob* job = pool_queue.front();
+        pool_queue.pop_front();
+        pool_running.push_back(job);
+        pthread_mutex_unlock(&pool_lock);
+        job->Run();
+        pthread_mutex_lock(&pool_lock);
+        pool_running.erase(std::find(pool_running.begin(),
+                                     pool_running.end(), job));
+        job->Finish();
+        pthread_cond_broadcast(&pool_done_cond);
+        if (job->future != NULL) {
+            pool_completed.push_back(job);
+            pool_notify();
         }
     }
-    else
-    {
-        char* cvalue;
-        PyObject* strvalue;
-        if ((strvalue = PyObject_Str(value)) == NULL) {
-            Py_DECREF(value);
-            return -1;
+    pool_threads--;
+    // wake up pool_shutdown()
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+/* queue a job and start missing worker threads, returns an errno value */
+static int
+pool_submit (ExpandJob* job) {
+    int err = 0;
+    pthread_mutex_lock(&pool_lock);
+    if (pool_closing) {
+        pthread_mutex_unlock(&pool_lock);
+        return ECANCELED;
+    }
+    while (pool_threads < pool_size) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        err = pthread_create(&thread, &attr, expand_worker, NULL);
+        pthread_attr_destroy(&attr);
+        if (err != 0)
+            break;
+        pool_threads++;
+    }
+    // one running thread is enough to make progress
+    if (pool_threads > 0) {
+        err = 0;
+        pool_queue.push_back(job);
+        pthread_cond_signal(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return err;
+}
+
+/* fork() only copies the calling thread. pool_lock is held across the
+   fork so that the child gets consistent pool state without any worker
+   threads; the jobs they would have run fail there with RuntimeError. */
+static void
+pool_atfork_prepare (void) {
+    pthread_mutex_lock(&pool_lock);
+}
+
+static void
+pool_atfork_parent (void) {
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void
+pool_atfork_child (void) {
+    pthread_mutex_init(&pool_lock, NULL);
+    pthread_cond_init(&pool_cond, NULL);
+    pthread_cond_init(&pool_done_cond, NULL);
+    pool_threads = 0;
+    pool_closing = false;
+    pool_running.insert(pool_running.end(), pool_queue.begin(),
+                        pool_queue.end());
+    pool_queue.clear();
+    for (size_t i = 0; i < pool_running.size(); i++) {
+        ExpandJob* job = pool_running[i];
+        job->lost = true;
+        job->Finish();
+        if (job->future != NULL)
+            pool_completed.push_back(job);
+    }
+    pool_running.clear();
+    // the parent keeps using the completion descriptor, the child gets
+    // its own under the same numbers
+    if (pool_fds[0] != -1) {
+        int fds[2];
+        if (pool_open_fds(fds)) {
+            if (fds[0] != pool_fds[0]) {
+                dup2(fds[0], pool_fds[0]);
+                close(fds[0]);
+            }
+            if (fds[1] != fds[0] && fds[1] != pool_fds[1]) {
+                dup2(fds[1], pool_fds[1]);
+                close(fds[1]);
+            }
+            if (!pool_completed.empty())
+                pool_notify();
         }
-        if ((cvalue = PyString_AsString(strvalue)) == NULL) {
-            Py_DECREF(value);
-            Py_DECREF(strvalue);
-            return -1;
+    }
+}
+
+/* run the queued jobs and wait for all worker threads to exit, call
+   without the GIL because the jobs may call Python modifiers */
+static void
+pool_shutdown (void) {
+    pthread_mutex_lock(&pool_lock);
+    pool_closing = true;
+    pthread_cond_broadcast(&pool_cond);
+    while (pool_threads > 0)
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+typedef struct {
+    PyObject_HEAD
+    ExpandJob* job;
+    // keep the template and dictionary alive while the job runs
+    PyObject* template_obj;
+    PyObject* dict_obj;
+} ExpandFuture_Object;
+
+
+/* dealloc ExpandFuture object */
+static void
+ExpandFuture_Dealloc (ExpandFuture_Object* self) {
+    if (self->job) {
+        // the worker still uses the dictionary
+        if (!pool_done(self->job)) {
+            Py_BEGIN_ALLOW_THREADS
+            pool_wait(self->job);
+            Py_END_ALLOW_THREADS
         }
-        self->dict->SetValue(ctemplate::TemplateString(cname),
-                             ctemplate::TemplateString(cvalue));
+        // added here, the worker does not hold the GIL
+        if (!self->job->lost)
+            timing_add(TIMING_EXPAND_ASYNC, self->job->start,
+                       self->job->end);
+        delete self->job;
+        self->job = NULL;
     }
-    Py_DECREF(value);
-    // XXX When strvalue is garbage collected, the internal char buffer
-    // is freed, which invalidates the TemplateString buffer.
-    // But then the strvalue ref is never decremented.
-    // Py_DECREF(strvalue);
-    return 0;
+    Py_XDECREF(self->template_obj);
+    Py_XDECREF(self->dict_obj);
+    self->ob_type->tp_free((PyObject*)self);
 }
 
-static PyMappingMethods dict_as_mapping = {
-    0, /* mp_length */
-    0, /* mp_subscript */
-    (objobjargproc)dict_ass_sub, /* mp_ass_subscript */
+/* ExpandFuture.done() -> bool */
+static PyObject*
+ExpandFuture_Done (ExpandFuture_Object* self, PyObject* args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+    return PyBool_FromLong(pool_done(self->job));
+}
+
+/* ExpandFuture.result() -> String */
+static PyObject*
+ExpandFuture_Result (ExpandFuture_Object* self, PyObject* args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+    if (!pool_done(self->job)) {
+        Py_BEGIN_ALLOW_THREADS
+        pool_wait(self->job);
+        Py_END_ALLOW_THREADS
+    }
+    if (self->job->lost) {
+        PyErr_SetString(PyExc_RuntimeError, "the expansion was lost in "
+                        "fork(), its worker thread exists in the parent "
+                        "process only");
+        return NULL;
+    }
+    return PyString_FromStringAndSize(self->job->output.data(),
+                                      self->job->output.length());
+}
+
+static PyMethodDef ExpandFuture_Methods[] = {
+    {"done", (PyCFunction)ExpandFuture_Done, METH_VARARGS,
+    "Return True if the expansion is done."},
+    {"result", (PyCFunction)ExpandFuture_Result, METH_VARARGS,
+    "Return the expanded string, waiting for the expansion to finish\n"
+    "(without holding the GIL) if it is not done yet."},
+    {NULL} /* Sentinel */
 };
 
-// It cannot be static because we have declared it as 'extern' before.
-// This would cause a linker error.
-PyTypeObject Dictionary_Type = {
+static PyTypeObject ExpandFuture_Type = {
     PyObject_HEAD_INIT(NULL)
     0,              /* ob_size */
-    "ctemplate.Dictionary",             /* tp_name */
-    sizeof(Dictionary_Object), /* tp_size */
+    "ctemplate.ExpandFuture",             /* tp_name */
+    sizeof(ExpandFuture_Object), /* tp_size */
     0,              /* tp_itemsize */
     /* methods */
-    (destructor)Dictionary_Dealloc, /* tp_dealloc */
+    (destructor)ExpandFuture_Dealloc, /* tp_dealloc */
     0,              /* tp_print */
     0,              /* tp_getattr */
     0,              /* tp_setattr */
@@ -375,7 +1897,7 @@ PyTypeObject Dictionary_Type = {
     0,              /* tp_repr */
     0,              /* tp_as_number */
     0,              /* tp_as_sequence */
-    &dict_as_mapping, /* tp_as_mapping */
+    0,              /* tp_as_mapping */
     0,              /* tp_hash */
     0,              /* tp_call */
     0,              /* tp_str */
@@ -383,47 +1905,146 @@ PyTypeObject Dictionary_Type = {
     0,              /* tp_setattro */
     0,              /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT, /* tp_flags */
-    "maps names (as found in template files) to their values.\n"
-    "There are three types of names:\n"
-    "  variables: value is a string.\n"
-    "  sections: value is a list of sub-dicts to use when expanding\n"
-    "    the section; the section is expanded once per sub-dict.\n"
-    "  template-include: value is a list of pairs: name of the template\n"
-    "    file to include, and the sub-dict to use when expanding it.\n"
-    "The object has routines for setting these values.", /* tp_doc */
+    "Pending result of Template.ExpandAsync().", /* tp_doc */
     0,              /* tp_traverse */
     0,              /* tp_clear */
     0,              /* tp_richcompare */
     0,              /* tp_weaklistoffset */
     0,              /* tp_iter */
     0,              /* tp_iternext */
-    Dictionary_Methods, /* tp_methods */
-    0,              /* tp_members */
-    0,              /* tp_getset */
-    0,              /* tp_base */
-    0,              /* tp_dict */
-    0,              /* tp_descr_get */
-    0,              /* tp_descr_set */
-    0,              /* tp_dictoffset */
-    (initproc)Dictionary_Init,  /* tp_init */
-    0,              /* tp_alloc */
-    Dictionary_New, /* tp_new */
-    0,              /* tp_free */
-    0,              /* tp_is_gc */
-    0,              /* tp_bases */
-    0,              /* tp_mro */
-    0,              /* tp_cache */
-    0,              /* tp_subclasses */
-    0,              /* tp_weaklist */
-    0,              /* tp_del */
+    ExpandFuture_Methods, /* tp_methods */
+};
+
+
+/*********************** Auto-Escape templates **********************/
+/* Auto-Escape is enabled by an AUTOESCAPE pragma at the start of a
+   template, see Template_Init(). For a context given to Template(), the
+   file is read once, the pragma is put in front of it and the result is
+   registered with StringToTemplateCache() under a key of its own. The
+   keys of a file are versioned: when ReloadAllIfChanged() or
+   Template.ReloadIfChanged() find a new mtime, the file is registered
+   again under a new key, because a cached key cannot be replaced and
+   older Template objects still use the old one. Only used with the GIL
+   held. */
+struct AutoEscapeEntry {
+    // as resolved, absolute or below the template root directory
+    std::string path;
+    const char* pragma;
+    int strip;
+    time_t mtime;
+    // key of the current version in the template cache, the path itself
+    // if the file has its own pragma, empty until the file was read
+    std::string key;
 };
+// path, pragma and strip -> entry
+static HASH_MAP<std::string, AutoEscapeEntry> autoescape_templates;
+static unsigned long autoescape_version = 0;
+
+/* Returns true if content starts with an AUTOESCAPE pragma, possibly
+   after whitespace and comments. */
+static bool
+has_autoescape_pragma (const std::string& content) {
+    size_t i = 0;
+    for (;;) {
+        i = content.find_first_not_of(" \t\r\n", i);
+        if (i == std::string::npos)
+            return false;
+        if (content.compare(i, 3, "{{!") != 0)
+            break;
+        i = content.find("}}", i + 3);
+        if (i == std::string::npos)
+            return false;
+        i += 2;
+    }
+    return content.compare(i, 13, "{{%AUTOESCAPE") == 0;
+}
+
+/* Read the template file path, relative to the template root directory
+   like in ctemplate, into content and its mtime into mtime. Returns
+   false if it is unreadable. Called without the GIL. */
+static bool
+read_template_file (const std::string& path, std::string* content,
+                    time_t* mtime) {
+    std::string fullpath = !path.empty() && path[0] == '/' ? path :
+        ctemplate::Template::template_root_directory() + path;
+    struct stat st;
+    if (stat(fullpath.c_str(), &st) == -1)
+        return false;
+    // only read the file again if it changed
+    if (st.st_mtime == *mtime)
+        return true;
+    *mtime = st.st_mtime;
+    FILE* fp = fopen(fullpath.c_str(), "rb");
+    if (fp == NULL)
+        return false;
+    char buf[8192];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+        content->append(buf, len);
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
 
+/* Register the current version of autoescape_templates[id] if it is new
+   or its file changed. Returns 1 if it was registered, 0 if it did not
+   change and -1 if the file is unreadable or id is unknown, e.g. after
+   ClearCache(). */
+static int
+autoescape_refresh (const std::string& id) {
+    HASH_MAP<std::string, AutoEscapeEntry>::iterator it =
+        autoescape_templates.find(id);
+    if (it == autoescape_templates.end())
+        return -1;
+    // a copy, the GIL is released and the map may change meanwhile
+    AutoEscapeEntry entry = it->second;
+    time_t mtime = entry.key.empty() ? (time_t)-1 : entry.mtime;
+    char version[32];
+    PyOS_snprintf(version, sizeof(version), "\n%lu", ++autoescape_version);
+    std::string key;
+    bool ok;
+    bool changed;
+    Py_BEGIN_ALLOW_THREADS
+    std::string content;
+    ok = read_template_file(entry.path, &content, &mtime);
+    changed = ok && (entry.key.empty() || mtime != entry.mtime);
+    ctemplate::Strip strip = strip_from_int(entry.strip);
+    if (changed && has_autoescape_pragma(content)) {
+        // the file enables Auto-Escape itself and is cached as a file,
+        // reloaded by ctemplate if it already was before
+        key = entry.path;
+        ctemplate::Template* tpl = ctemplate::Template::GetTemplate(key,
+                                                                    strip);
+        if (tpl != NULL && entry.key != entry.path)
+            tpl->ReloadIfChanged();
+    }
+    else if (changed) {
+        content.insert(0, entry.pragma);
+        key = id + version;
+        ctemplate::StringToTemplateCache(key, content, strip);
+    }
+    Py_END_ALLOW_THREADS
+    if (!ok)
+        return -1;
+    if (!changed)
+        return 0;
+    entry.key = key;
+    entry.mtime = mtime;
+    autoescape_templates[id] = entry;
+    return 1;
+}
 
 /**************************** Template ******************************/
 
 typedef struct {
     PyObject_HEAD
     ctemplate::Template* ctemplate;
+    // key into autoescape_templates if loaded with a context, else NULL
+    std::string* autoescape_id;
+    // the key self->ctemplate was loaded by then
+    std::string* autoescape_key;
+    // size of the last ExpandInto() result, see there
+    Py_ssize_t last_size;
 } Template_Object;
 
 
@@ -435,6 +2056,9 @@ Template_New (PyTypeObject* type, PyObject* args, PyObject* kwds) {
         return NULL;
     }
     self->ctemplate = NULL;
+    self->autoescape_id = NULL;
+    self->autoescape_key = NULL;
+    self->last_size = 0;
     return (PyObject*)self;
 }
 
@@ -443,11 +2067,63 @@ static int
 Template_Init (Template_Object* self, PyObject* args) {
     PyObject* filename;
     int strip;
-    if (!PyArg_ParseTuple(args, "Si", &filename, &strip))
+    int icontext = ctemplate::TC_UNUSED;
+    if (!PyArg_ParseTuple(args, "Si|i", &filename, &strip, &icontext))
         return -1;
+    const char* pragma;
+    if (!autoescape_pragma(icontext, &pragma)) {
+        PyErr_Format(PyExc_ValueError, "unknown template context %d",
+                     icontext);
+        return -1;
+    }
     const char* cfilename = PyString_AsString(filename);
-    self->ctemplate = ctemplate::Template::GetTemplate(std::string(cfilename),
-                                                    strip_from_int(strip));
+    std::string path;
+    if (!resolve_template(std::string(cfilename), &path)) {
+        PyErr_Format(PyExc_IOError, "file `%s' not found in template "
+                     "search path", cfilename);
+        return -1;
+    }
+    // Auto-Escape is enabled by the AUTOESCAPE pragma at the start of the
+    // template, the file is read only the first time it is used with this
+    // context, see autoescape_refresh()
+    std::string key = path;
+    delete self->autoescape_id;
+    delete self->autoescape_key;
+    self->autoescape_id = NULL;
+    self->autoescape_key = NULL;
+    if (pragma != NULL) {
+        std::string id = path + "\n" + pragma + "\n" + (char)('0' + strip);
+        if (autoescape_templates.find(id) == autoescape_templates.end()) {
+            AutoEscapeEntry entry;
+            entry.path = path;
+            entry.pragma = pragma;
+            entry.strip = strip;
+            entry.mtime = -1;
+            autoescape_templates[id] = entry;
+        }
+        if (autoescape_templates[id].key.empty()
+            && autoescape_refresh(id) == -1) {
+            PyErr_Format(PyExc_IOError, "non-existing or unreadable file "
+                         "`%s'", cfilename);
+            return -1;
+        }
+        key = autoescape_templates[id].key;
+        self->autoescape_id = new std::string(id);
+        self->autoescape_key = new std::string(key);
+    }
+    ctemplate::Template* tpl;
+    // without the GIL, because an ExpandAsync() worker may hold a template
+    // lock while waiting for the GIL in a Python modifier
+    double start, end;
+    Py_BEGIN_ALLOW_THREADS
+    start = timing_now();
+    CTEMPLATE_PROBE2(template__load__start, path.c_str(), strip);
+    tpl = ctemplate::Template::GetTemplate(key, strip_from_int(strip));
+    CTEMPLATE_PROBE2(template__load__done, path.c_str(), tpl != NULL);
+    end = timing_now();
+    Py_END_ALLOW_THREADS
+    timing_add(TIMING_LOAD, start, end);
+    self->ctemplate = tpl;
     // raise IOError when template filename was not readable
     if (self->ctemplate == NULL) {
         PyErr_Format(PyExc_IOError, "non-existing or unreadable file `%s'",
@@ -461,6 +2137,8 @@ Template_Init (Template_Object* self, PyObject* args) {
 static void
 Template_Dealloc (Template_Object* self) {
     // note that self->ctemplate will be deleted by ctemplate::ClearCache()
+    delete self->autoescape_id;
+    delete self->autoescape_key;
     self->ob_type->tp_free((PyObject*)self);
 }
 
@@ -468,13 +2146,199 @@ Template_Dealloc (Template_Object* self) {
 static PyObject*
 Template_Expand (Template_Object* self, PyObject* args) {
     Dictionary_Object* dict;
-    if (!PyArg_ParseTuple(args, "O", &dict))
+    if (!PyArg_ParseTuple(args, "O!", &Dictionary_Type, &dict))
         return NULL;
     std::string output;
+    // the template is locked during the expansion, see Template_Init()
+    dict->tree->BeginExpand();
+    double start, end;
+    Py_BEGIN_ALLOW_THREADS
+    start = timing_now();
+    CTEMPLATE_PROBE1(expand__start, self->ctemplate->template_file());
     self->ctemplate->Expand(&output, dict->dict);
+    CTEMPLATE_PROBE2(expand__done, self->ctemplate->template_file(),
+                     output.length());
+    end = timing_now();
+    Py_END_ALLOW_THREADS
+    timing_add(TIMING_EXPAND, start, end);
+    dict->tree->EndExpand();
     return PyString_FromStringAndSize(output.c_str(), output.length());
 }
 
+/* Template.ExpandInto(buffer, dict[, offset]) -> int */
+static PyObject*
+Template_ExpandInto (Template_Object* self, PyObject* args) {
+    PyObject* buffer;
+    Dictionary_Object* dict;
+    Py_ssize_t offset = 0;
+    if (!PyArg_ParseTuple(args, "OO!|n", &buffer, &Dictionary_Type, &dict,
+                          &offset))
+        return NULL;
+    // check the buffer before expanding
+    bool is_bytearray = PyByteArray_Check(buffer);
+    bool is_view = !is_bytearray && PyObject_CheckBuffer(buffer);
+    void* vdata;
+    Py_ssize_t len = 0;
+    if (!is_bytearray && !is_view) {
+        // raises TypeError if buffer is not writable
+        if (PyObject_AsWriteBuffer(buffer, &vdata, &len) == -1)
+            return NULL;
+    }
+    Py_buffer view;
+    if (is_view) {
+        if (PyObject_GetBuffer(buffer, &view, PyBUF_WRITABLE) == -1)
+            return NULL;
+        len = view.len;
+    }
+    if (!is_bytearray && (offset < 0 || offset > len)) {
+        if (is_view)
+            PyBuffer_Release(&view);
+        PyErr_Format(PyExc_ValueError, "offset %zd out of buffer range",
+                     offset);
+        return NULL;
+    }
+    // A view keeps its memory in place and is filled directly. When it
+    // is smaller than the last result, the expansion is expected not to
+    // fit and goes to a string first, so the buffer is left untouched.
+    if (is_view && len - offset >= self->last_size) {
+        FixedBufferEmitter emitter((char*)view.buf + offset, len - offset);
+        dict->tree->BeginExpand();
+        double start, end;
+        Py_BEGIN_ALLOW_THREADS
+        start = timing_now();
+        CTEMPLATE_PROBE1(expand__start, self->ctemplate->template_file());
+        self->ctemplate->Expand(&emitter, dict->dict);
+        CTEMPLATE_PROBE2(expand__done, self->ctemplate->template_file(),
+                         emitter.needed);
+        end = timing_now();
+        Py_END_ALLOW_THREADS
+        timing_add(TIMING_EXPAND, start, end);
+        dict->tree->EndExpand();
+        PyBuffer_Release(&view);
+        self->last_size = emitter.needed;
+        if (emitter.needed > len - offset) {
+            PyErr_Format(PyExc_ValueError,
+                         "buffer too small, expansion needs %zd bytes",
+                         emitter.needed);
+            return NULL;
+        }
+        return PyInt_FromSsize_t(emitter.needed);
+    }
+    if (is_view)
+        PyBuffer_Release(&view);
+    // The expansion runs without the GIL, see Template_Init(). Growing a
+    // bytearray needs the GIL and an old-style buffer may be moved by
+    // another thread, so these are expanded into a string first.
+    std::string output;
+    dict->tree->BeginExpand();
+    double start, end;
+    Py_BEGIN_ALLOW_THREADS
+    start = timing_now();
+    CTEMPLATE_PROBE1(expand__start, self->ctemplate->template_file());
+    self->ctemplate->Expand(&output, dict->dict);
+    CTEMPLATE_PROBE2(expand__done, self->ctemplate->template_file(),
+                     output.length());
+    end = timing_now();
+    Py_END_ALLOW_THREADS
+    timing_add(TIMING_EXPAND, start, end);
+    dict->tree->EndExpand();
+    Py_ssize_t needed = output.length();
+    self->last_size = needed;
+    // a bytearray grows, the expanded text is appended to it
+    if (is_bytearray) {
+        Py_ssize_t size = PyByteArray_GET_SIZE(buffer);
+        if (PyByteArray_Resize(buffer, size + needed) == -1)
+            return NULL;
+        memcpy(PyByteArray_AS_STRING(buffer) + size, output.data(), needed);
+        return PyInt_FromSsize_t(needed);
+    }
+    // the buffer may have been resized meanwhile
+    if (is_view) {
+        if (PyObject_GetBuffer(buffer, &view, PyBUF_WRITABLE) == -1)
+            return NULL;
+        vdata = view.buf;
+        len = view.len;
+    }
+    else if (PyObject_AsWriteBuffer(buffer, &vdata, &len) == -1)
+        return NULL;
+    if (offset > len || needed > len - offset) {
+        if (is_view)
+            PyBuffer_Release(&view);
+        PyErr_Format(PyExc_ValueError,
+                     "buffer too small, expansion needs %zd bytes", needed);
+        return NULL;
+    }
+    memcpy((char*)vdata + offset, output.data(), needed);
+    if (is_view)
+        PyBuffer_Release(&view);
+    return PyInt_FromSsize_t(needed);
+}
+
+/* Template.ExpandToBuffer(dict) -> ExpandResult */
+static PyObject*
+Template_ExpandToBuffer (Template_Object* self, PyObject* args) {
+    Dictionary_Object* dict;
+    if (!PyArg_ParseTuple(args, "O!", &Dictionary_Type, &dict))
+        return NULL;
+    ExpandResult_Object* result;
+    PyTypeObject* type = &ExpandResult_Type;
+    if ((result = (ExpandResult_Object*) type->tp_alloc(type, 0)) == NULL) {
+        return NULL;
+    }
+    result->output = new std::string();
+    dict->tree->BeginExpand();
+    double start, end;
+    Py_BEGIN_ALLOW_THREADS
+    start = timing_now();
+    CTEMPLATE_PROBE1(expand__start, self->ctemplate->template_file());
+    self->ctemplate->Expand(result->output, dict->dict);
+    CTEMPLATE_PROBE2(expand__done, self->ctemplate->template_file(),
+                     result->output->length());
+    end = timing_now();
+    Py_END_ALLOW_THREADS
+    timing_add(TIMING_EXPAND, start, end);
+    dict->tree->EndExpand();
+    return (PyObject*)result;
+}
+
+/* Template.ExpandAsync(dict) -> ExpandFuture */
+static PyObject*
+Template_ExpandAsync (Template_Object* self, PyObject* args) {
+    Dictionary_Object* dict;
+    if (!PyArg_ParseTuple(args, "O!", &Dictionary_Type, &dict))
+        return NULL;
+    ExpandFuture_Object* future;
+    PyTypeObject* type = &ExpandFuture_Type;
+    if ((future = (ExpandFuture_Object*) type->tp_alloc(type, 0)) == NULL) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    future->template_obj = (PyObject*)self;
+    Py_INCREF(dict);
+    future->dict_obj = (PyObject*)dict;
+    ExpandJob* job = new ExpandJob(self->ctemplate, dict->tree, dict->dict);
+    // reported through the completion descriptor once it is in use, the
+    // reference is passed on by CollectExpanded()
+    if (pool_fds[0] != -1) {
+        Py_INCREF(future);
+        job->future = (PyObject*)future;
+    }
+    // ended by the worker, see ExpandJob::Run()
+    dict->tree->BeginExpand();
+    int err = pool_submit(job);
+    if (err != 0) {
+        dict->tree->EndExpand();
+        if (job->future != NULL)
+            Py_DECREF(future);
+        delete job;
+        Py_DECREF(future);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    future->job = job;
+    return (PyObject*)future;
+}
+
 /* Template.state() -> int */
 static PyObject*
 Template_State (Template_Object* self, PyObject* args) {
@@ -488,13 +2352,74 @@ static PyObject*
 Template_ReloadIfChanged (Template_Object* self, PyObject* args) {
     if (!PyArg_ParseTuple(args, ""))
         return NULL;
-    return PyBool_FromLong(self->ctemplate->ReloadIfChanged());
+    CTEMPLATE_PROBE1(reload__start, self->ctemplate->template_file());
+    bool reloaded;
+    HASH_MAP<std::string, AutoEscapeEntry>::iterator it;
+    if (self->autoescape_id != NULL) {
+        // registered again under a new key if the file changed, maybe
+        // already by ReloadAllIfChanged() or another Template object
+        autoescape_refresh(*self->autoescape_id);
+        it = autoescape_templates.find(*self->autoescape_id);
+    }
+    // unless the file has its own pragma and is reloaded like any other
+    if (self->autoescape_id != NULL
+        && (it == autoescape_templates.end()
+            || it->second.key != it->second.path
+            || it->second.key != *self->autoescape_key)) {
+        reloaded = false;
+        if (it != autoescape_templates.end() && !it->second.key.empty()
+            && it->second.key != *self->autoescape_key) {
+            std::string key = it->second.key;
+            ctemplate::Strip strip = strip_from_int(it->second.strip);
+            ctemplate::Template* tpl;
+            double start, end;
+            Py_BEGIN_ALLOW_THREADS
+            start = timing_now();
+            tpl = ctemplate::Template::GetTemplate(key, strip);
+            end = timing_now();
+            Py_END_ALLOW_THREADS
+            timing_add(TIMING_RELOAD, start, end);
+            if (tpl != NULL) {
+                self->ctemplate = tpl;
+                *self->autoescape_key = key;
+                reloaded = tpl->state() == ctemplate::TS_READY;
+            }
+        }
+        CTEMPLATE_PROBE2(reload__done, self->ctemplate->template_file(),
+                         reloaded);
+        return PyBool_FromLong(reloaded);
+    }
+    double start, end;
+    Py_BEGIN_ALLOW_THREADS
+    start = timing_now();
+    reloaded = self->ctemplate->ReloadIfChanged();
+    CTEMPLATE_PROBE2(reload__done, self->ctemplate->template_file(),
+                     reloaded);
+    end = timing_now();
+    Py_END_ALLOW_THREADS
+    timing_add(TIMING_RELOAD, start, end);
+    return PyBool_FromLong(reloaded);
 }
 
 static PyMethodDef Template_Methods[] = {
     {"Expand", (PyCFunction)Template_Expand, METH_VARARGS,
     "Expands the template into a string using the values\n"
     "in the supplied dictionary."},
+    {"ExpandInto", (PyCFunction)Template_ExpandInto, METH_VARARGS,
+    "Expands the template straight into a writable buffer and returns\n"
+    "the number of bytes written. A bytearray is appended to; any other\n"
+    "writable buffer is filled starting at the optional offset and\n"
+    "ValueError is raised when it is too small. The buffer is then left\n"
+    "unchanged if it is smaller than the previous expansion of this\n"
+    "template; otherwise it may hold a truncated prefix of the result.\n"
+    "TypeError is raised before expanding if buffer is not writable."},
+    {"ExpandToBuffer", (PyCFunction)Template_ExpandToBuffer, METH_VARARGS,
+    "Expands the template like Expand(), but returns an ExpandResult\n"
+    "buffer object owning the expanded text instead of a copy of it."},
+    {"ExpandAsync", (PyCFunction)Template_ExpandAsync, METH_VARARGS,
+    "Expands the template in a native worker thread without holding\n"
+    "the GIL and returns an ExpandFuture. The dictionary must not be\n"
+    "changed until the expansion is done."},
     {"ReloadIfChanged", (PyCFunction)Template_ReloadIfChanged, METH_VARARGS,
     "Reloads the file from the filesystem iff its mtime is different\n"
     "now from what it was last time the file was reloaded.  Note a\n"
@@ -533,7 +2458,13 @@ static PyTypeObject Template_Type = {
     0,              /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT, /* tp_flags */
     "Object which reads and parses the template file and then is used to\n"
-    "expand the parsed structure to a string.", /* tp_doc */
+    "expand the parsed structure to a string.\n"
+    "Template(filename, strip[, context]): if context is one of the\n"
+    "TC_* constants other than TC_UNUSED and TC_MANUAL, the template is\n"
+    "loaded in Auto-Escape mode and variables are escaped for that\n"
+    "context. It is reloaded by ReloadIfChanged() and\n"
+    "ReloadAllIfChanged() like any other template.",
+    /* tp_doc */
     0,              /* tp_traverse */
     0,              /* tp_clear */
     0,              /* tp_richcompare */
@@ -561,6 +2492,11 @@ static PyTypeObject Template_Type = {
     0,              /* tp_del */
 };
 
+static PyObject *
+ctemplate_GetTemplate (PyObject* self, PyObject* args) {
+    return PyObject_Call((PyObject*)&Template_Type, args, NULL);
+}
+
 static PyObject *
 ctemplate_SetGlobalValue (PyObject* self, PyObject* args) {
     const char* name;
@@ -580,9 +2516,11 @@ ctemplate_SetGlobalValue (PyObject* self, PyObject* args) {
         Py_DECREF(value_obj);
         return NULL;
     }
+    Py_BEGIN_ALLOW_THREADS
     ctemplate::TemplateDictionary::
         SetGlobalValue(ctemplate::TemplateString(name, name_len),
                        ctemplate::TemplateString(value, value_len));
+    Py_END_ALLOW_THREADS
     Py_DECREF(obj);
     Py_DECREF(value_obj);
     Py_RETURN_NONE;
@@ -593,8 +2531,60 @@ ctemplate_SetTemplateRootDirectory (PyObject* self, PyObject* args) {
     const char* name;
     if (!PyArg_ParseTuple(args, "s", &name))
         return NULL;
-    return PyBool_FromLong(ctemplate::Template::
-                           SetTemplateRootDirectory(std::string(name)));
+    clear_resolve_cache();
+    std::string dir(name);
+    bool result;
+    Py_BEGIN_ALLOW_THREADS
+    result = ctemplate::Template::SetTemplateRootDirectory(dir);
+    Py_END_ALLOW_THREADS
+    return PyBool_FromLong(result);
+}
+
+static PyObject *
+ctemplate_SetTemplateSearchPath (PyObject* self, PyObject* args) {
+    PyObject* dirs;
+    if (!PyArg_ParseTuple(args, "O", &dirs))
+        return NULL;
+    PyObject* seq;
+    if ((seq = PySequence_Fast(dirs, "search path must be a sequence"))
+        == NULL)
+        return NULL;
+    std::vector<std::string> path;
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        char* dir;
+        Py_ssize_t dir_len;
+        if (PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(seq, i),
+                                     &dir, &dir_len) == -1) {
+            Py_DECREF(seq);
+            return NULL;
+        }
+        path.push_back(std::string(dir, dir_len));
+    }
+    Py_DECREF(seq);
+    search_path.swap(path);
+    clear_resolve_cache();
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ctemplate_GetTemplateSearchPath (PyObject* self, PyObject* args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+    PyObject* pylist;
+    if ((pylist = PyList_New(search_path.size())) == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < search_path.size(); i++) {
+        PyObject* obj;
+        if ((obj = PyString_FromStringAndSize(search_path[i].data(),
+                                              search_path[i].length()))
+            == NULL) {
+            Py_DECREF(pylist);
+            return NULL;
+        }
+        PyList_SET_ITEM(pylist, i, obj);
+    }
+    return pylist;
 }
 
 static PyObject *
@@ -605,11 +2595,139 @@ ctemplate_GetTemplateRootDirectory (PyObject* self, PyObject* args) {
     return PyString_FromString(name.c_str());
 }
 
+static PyObject *
+ctemplate_SetExpandThreads (PyObject* self, PyObject* args) {
+    int num;
+    if (!PyArg_ParseTuple(args, "i", &num))
+        return NULL;
+    if (num < 1) {
+        PyErr_SetString(PyExc_ValueError, "need at least one thread");
+        return NULL;
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_size = num;
+    // surplus threads exit, missing ones are started on the next submit
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ctemplate_GetExpandFd (PyObject* self, PyObject* args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+    if (pool_fds[0] == -1) {
+        int fds[2];
+        if (!pool_open_fds(fds))
+            return PyErr_SetFromErrno(PyExc_OSError);
+        // the workers only use pool_fds for jobs queued after this
+        pool_fds[0] = fds[0];
+        pool_fds[1] = fds[1];
+    }
+    return PyInt_FromLong(pool_fds[0]);
+}
+
+static PyObject *
+ctemplate_CollectExpanded (PyObject* self, PyObject* args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+    std::deque<ExpandJob*> completed;
+    if (pool_fds[0] != -1) {
+        // drained first, so that a job finishing meanwhile is either
+        // returned now or makes the descriptor readable again
+        pool_drain();
+        pthread_mutex_lock(&pool_lock);
+        completed.swap(pool_completed);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    PyObject* pylist;
+    if ((pylist = PyList_New(completed.size())) == NULL) {
+        // put them back for the next call
+        pthread_mutex_lock(&pool_lock);
+        pool_completed.insert(pool_completed.begin(), completed.begin(),
+                              completed.end());
+        pthread_mutex_unlock(&pool_lock);
+        return NULL;
+    }
+    for (size_t i = 0; i < completed.size(); i++) {
+        // the reference taken by ExpandAsync() goes to the list
+        PyList_SET_ITEM(pylist, i, completed[i]->future);
+        completed[i]->future = NULL;
+    }
+    return pylist;
+}
+
+static PyObject *
+ctemplate__SetNativeTimings (PyObject* self, PyObject* args) {
+    PyObject* enabled;
+    if (!PyArg_ParseTuple(args, "O", &enabled))
+        return NULL;
+    int b = PyObject_IsTrue(enabled);
+    if (b == -1)
+        return NULL;
+    timing_enabled = b;
+    for (int i = 0; i < NUM_TIMINGS; i++)
+        timings[i].clear();
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ctemplate__GetNativeTimings (PyObject* self, PyObject* args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+    PyObject* pydict;
+    if ((pydict = PyDict_New()) == NULL)
+        return NULL;
+    for (int i = 0; i < NUM_TIMINGS; i++) {
+        PyObject* pylist;
+        if ((pylist = PyList_New(timings[i].size())) == NULL) {
+            Py_DECREF(pydict);
+            return NULL;
+        }
+        for (size_t j = 0; j < timings[i].size(); j++) {
+            PyObject* obj;
+            if ((obj = PyFloat_FromDouble(timings[i][j])) == NULL) {
+                Py_DECREF(pylist);
+                Py_DECREF(pydict);
+                return NULL;
+            }
+            PyList_SET_ITEM(pylist, j, obj);
+        }
+        int err = PyDict_SetItemString(pydict, timing_names[i], pylist);
+        Py_DECREF(pylist);
+        if (err == -1) {
+            Py_DECREF(pydict);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < NUM_TIMINGS; i++)
+        timings[i].clear();
+    return pydict;
+}
+
 static PyObject *
 ctemplate_ReloadAllIfChanged (PyObject* self, PyObject* args) {
     if (!PyArg_ParseTuple(args, ""))
         return NULL;
+    CTEMPLATE_PROBE0(reload__all__start);
+    clear_resolve_cache();
+    double start, end;
+    Py_BEGIN_ALLOW_THREADS
+    start = timing_now();
     ctemplate::Template::ReloadAllIfChanged();
+    end = timing_now();
+    Py_END_ALLOW_THREADS
+    timing_add(TIMING_RELOAD_ALL, start, end);
+    // auto-escaped templates are in the cache by keys that are not file
+    // names, register those whose file changed again
+    std::vector<std::string> ids;
+    for (HASH_MAP<std::string, AutoEscapeEntry>::iterator it =
+             autoescape_templates.begin();
+         it != autoescape_templates.end(); ++it)
+        ids.push_back(it->first);
+    for (size_t i = 0; i < ids.size(); i++)
+        autoescape_refresh(ids[i]);
+    CTEMPLATE_PROBE0(reload__all__done);
     Py_RETURN_NONE;
 }
 
@@ -617,7 +2735,11 @@ static PyObject *
 ctemplate_ClearCache (PyObject* self, PyObject* args) {
     if (!PyArg_ParseTuple(args, ""))
         return NULL;
+    Py_BEGIN_ALLOW_THREADS
     ctemplate::Template::ClearCache();
+    Py_END_ALLOW_THREADS
+    clear_resolve_cache();
+    autoescape_templates.clear();
     Py_RETURN_NONE;
 }
 
@@ -643,9 +2765,12 @@ ctemplate_GetBadSyntaxList (PyObject* self, PyObject* args) {
         return NULL;
     }
     Py_DECREF(obj);
-    ctemplate::TemplateNamelist::SyntaxListType the_list =
-        ctemplate::TemplateNamelist::
+    ctemplate::TemplateNamelist::SyntaxListType the_list;
+    // parses templates, see Template_Init()
+    Py_BEGIN_ALLOW_THREADS
+    the_list = ctemplate::TemplateNamelist::
         GetBadSyntaxList((refresh==1), strip_from_int(i));
+    Py_END_ALLOW_THREADS
     PyObject* pylist;
     if ((pylist = PyList_New(the_list.size())) == NULL) {
         return NULL;
@@ -666,8 +2791,11 @@ ctemplate_GetBadSyntaxList (PyObject* self, PyObject* args) {
 
 class PythonTemplateModifier : public ctemplate::TemplateModifier {
     PyObject *modifier_function;
+    // only used to identify the modifier in tracepoints
+    std::string long_name;
 public:
-    PythonTemplateModifier(PyObject *modifier_function) : modifier_function(modifier_function) {
+    PythonTemplateModifier(PyObject *modifier_function, const char* long_name)
+        : modifier_function(modifier_function), long_name(long_name) {
         Py_INCREF(modifier_function);
     }
 
@@ -680,15 +2808,32 @@ public:
                         ctemplate::ExpandEmitter* outbuf,
                         const std::string& arg) const {
         PyObject *arglist, *result;
+        char* out;
+        Py_ssize_t outlen;
 
+        // before taking the GIL, so the time waiting for it is traced
+        CTEMPLATE_PROBE2(modifier__entry, long_name.c_str(), inlen);
+        // expansions started by Template.ExpandAsync() run in a worker
+        // thread without the GIL
+        PyGILState_STATE gstate = PyGILState_Ensure();
         arglist = Py_BuildValue("(s#,s#)",
             in, (Py_ssize_t)inlen, arg.c_str(), (Py_ssize_t)arg.size());
         result = PyObject_CallObject(modifier_function, arglist);
-        Py_DECREF(arglist);
+        Py_XDECREF(arglist);
 
-        outbuf->Emit(PyString_AsString(result));
+        // the expansion cannot be aborted, so errors are only reported
+        if (result == NULL ||
+            PyString_AsStringAndSize(result, &out, &outlen) == -1) {
+            PyErr_WriteUnraisable(modifier_function);
+            outlen = -1;
+        }
+        else {
+            outbuf->Emit(out, outlen);
+        }
+        CTEMPLATE_PROBE2(modifier__return, long_name.c_str(), outlen);
 
-        Py_DECREF(result);
+        Py_XDECREF(result);
+        PyGILState_Release(gstate);
     }
 };
 
@@ -712,7 +2857,7 @@ DoAddModifier(PyObject* args, bool xss_safe) {
         return NULL;
     
     //TODO memory is never freed...
-    ctemplate::TemplateModifier * modifier = new PythonTemplateModifier(callback);
+    ctemplate::TemplateModifier * modifier = new PythonTemplateModifier(callback, long_name);
 
     if (xss_safe)
         ctemplate::AddXssSafeModifier(long_name, modifier);
@@ -733,6 +2878,9 @@ ctemplate_AddXssSafeModifier(PyObject* self, PyObject* args) {
 }
 
 static PyMethodDef ctemplate_methods[] = {
+    {"GetTemplate", (PyCFunction)ctemplate_GetTemplate, METH_VARARGS,
+    "GetTemplate(filename, strip[, context]) -> Template\n"
+    "Same as Template(filename, strip[, context])."},
     {"SetGlobalValue", (PyCFunction)ctemplate_SetGlobalValue, METH_VARARGS,
     "Set global variable value."},
     {"SetTemplateRootDirectory", (PyCFunction)ctemplate_SetTemplateRootDirectory, METH_VARARGS,
@@ -742,6 +2890,41 @@ static PyMethodDef ctemplate_methods[] = {
      "this root-directory is prepended to the filename.\n"},
     {"GetTemplateRootDirectory", (PyCFunction)ctemplate_GetTemplateRootDirectory, METH_VARARGS,
      "Returns the stored template root directory name"},
+    {"SetTemplateSearchPath", (PyCFunction)ctemplate_SetTemplateSearchPath, METH_VARARGS,
+     "Sets a list of directories searched for templates with a relative\n"
+     "filename. The first directory containing the file is used; relative\n"
+     "directories are below the template root directory. Lookups are\n"
+     "cached until ReloadAllIfChanged(). An empty list disables the\n"
+     "search. Include filenames set with Dictionary.SetFilename() are\n"
+     "looked up as well.\n"},
+    {"GetTemplateSearchPath", (PyCFunction)ctemplate_GetTemplateSearchPath, METH_VARARGS,
+     "Returns the list of template search path directories"},
+    {"SetExpandThreads", (PyCFunction)ctemplate_SetExpandThreads, METH_VARARGS,
+     "Sets the number of native worker threads used by\n"
+     "Template.ExpandAsync(). The default is 4."},
+    {"GetExpandFd", (PyCFunction)ctemplate_GetExpandFd, METH_VARARGS,
+     "Returns a file descriptor that is readable while expansions of\n"
+     "Template.ExpandAsync() are done that CollectExpanded() has not\n"
+     "returned yet. Only futures created after the first call are\n"
+     "reported. Register it once with the event loop, e.g.\n"
+     "loop.add_reader()."},
+    {"CollectExpanded", (PyCFunction)ctemplate_CollectExpanded,
+     METH_VARARGS,
+     "Returns the list of ExpandFuture objects done since the last call\n"
+     "and makes the descriptor of GetExpandFd() unreadable again. Done\n"
+     "futures are kept until they are collected."},
+    {"_SetNativeTimings", (PyCFunction)ctemplate__SetNativeTimings,
+     METH_VARARGS,
+     "_SetNativeTimings(enabled)\n"
+     "Debugging aid: starts or stops recording how long the library calls\n"
+     "of Template(), the expand methods and the reload functions take\n"
+     "without the GIL, and discards the samples so far."},
+    {"_GetNativeTimings", (PyCFunction)ctemplate__GetNativeTimings,
+     METH_VARARGS,
+     "_GetNativeTimings() -> dict\n"
+     "Returns and discards the samples of _SetNativeTimings(), a list of\n"
+     "seconds for each of GetTemplate, Expand, ExpandAsync,\n"
+     "ReloadIfChanged and ReloadAllIfChanged."},
     {"ReloadAllIfChanged", (PyCFunction)ctemplate_ReloadAllIfChanged,
      METH_VARARGS,
      "Marks each template object in the cache to check to see if\n"
@@ -829,6 +3012,13 @@ add_constants (PyObject* m) {
     PyModule_AddIntConstant(m, "TS_EMPTY", ctemplate::TS_EMPTY);
     PyModule_AddIntConstant(m, "TS_ERROR", ctemplate::TS_ERROR);
     PyModule_AddIntConstant(m, "TS_READY", ctemplate::TS_READY);
+    PyModule_AddIntConstant(m, "TC_UNUSED", ctemplate::TC_UNUSED);
+    PyModule_AddIntConstant(m, "TC_HTML", ctemplate::TC_HTML);
+    PyModule_AddIntConstant(m, "TC_JS", ctemplate::TC_JS);
+    PyModule_AddIntConstant(m, "TC_CSS", ctemplate::TC_CSS);
+    PyModule_AddIntConstant(m, "TC_JSON", ctemplate::TC_JSON);
+    PyModule_AddIntConstant(m, "TC_XML", ctemplate::TC_XML);
+    PyModule_AddIntConstant(m, "TC_MANUAL", ctemplate::TC_MANUAL);
 }
 
 static void
@@ -836,10 +3026,26 @@ clear_template_cache (void) {
     ctemplate::Template::ClearCache();
 }
 
+/* registered with atexit: finish ExpandAsync() jobs while the interpreter
+   is still alive, their Python modifiers need it */
+static PyObject *
+ctemplate_Shutdown (PyObject* self, PyObject* args) {
+    Py_BEGIN_ALLOW_THREADS
+    pool_shutdown();
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef ctemplate_shutdown_def = {
+    "_shutdown", (PyCFunction)ctemplate_Shutdown, METH_NOARGS,
+    "Waits for the ExpandAsync() worker threads to finish and exit."
+};
+
 extern "C" {
 
 static void
 ctemplate_Cleanup (void) {
+    // the worker threads were stopped by ctemplate_Shutdown()
     clear_template_cache();
 }
 
@@ -849,12 +3055,24 @@ ctemplate_Cleanup (void) {
 /* initialization of the module */
 PyMODINIT_FUNC initctemplate (void) {
     PyObject* m;
+    PyObject* atexit_module;
+    PyObject* result;
     if (PyType_Ready(&Template_Type) < 0) {
         return;
     }
     if (PyType_Ready(&Dictionary_Type) < 0) {
         return;
     }
+    if (PyType_Ready(&ExpandResult_Type) < 0) {
+        return;
+    }
+    if (PyType_Ready(&ExpandFuture_Type) < 0) {
+        return;
+    }
+    /* worker threads of ExpandAsync() call Python template modifiers */
+    PyEval_InitThreads();
+    pthread_atfork(pool_atfork_prepare, pool_atfork_parent,
+                   pool_atfork_child);
     m = Py_InitModule3("ctemplate", ctemplate_methods,
                        "Wrapper for the ctemplate library.");
     if (m == NULL) {
@@ -863,6 +3081,18 @@ PyMODINIT_FUNC initctemplate (void) {
     /* Register cleanup function */
     if (Py_AtExit(ctemplate_Cleanup) == -1)
         goto onError;
+    /* Py_AtExit functions run after the interpreter is gone, so the
+       worker threads are stopped earlier */
+    if ((atexit_module = PyImport_ImportModule("atexit")) == NULL)
+        goto onError;
+    result = PyObject_CallMethod(atexit_module, (char*)"register",
+                                 (char*)"N",
+                                 PyCFunction_New(&ctemplate_shutdown_def,
+                                                 NULL));
+    Py_DECREF(atexit_module);
+    if (result == NULL)
+        goto onError;
+    Py_DECREF(result);
 
     Py_INCREF(&Template_Type);
     if (PyModule_AddObject(m, "Template",
@@ -874,6 +3104,16 @@ PyMODINIT_FUNC initctemplate (void) {
                            (PyObject *)&Dictionary_Type) == -1) {
         goto onError;
     }
+    Py_INCREF(&ExpandResult_Type);
+    if (PyModule_AddObject(m, "ExpandResult",
+                           (PyObject *)&ExpandResult_Type) == -1) {
+        goto onError;
+    }
+    Py_INCREF(&ExpandFuture_Type);
+    if (PyModule_AddObject(m, "ExpandFuture",
+                           (PyObject *)&ExpandFuture_Type) == -1) {
+        goto onError;
+    }
     add_constants(m);
 onError:
     if (PyErr_Occurred())
@@ -0,0 +1,232 @@
+#!/usr/bin/python
+# -*- coding: iso-8859-1 -*-
+"""Concurrency stress test for template expansion during reloads.
+
+Runs several threads expanding a template while another thread keeps
+rewriting the template file and calls ReloadIfChanged(),
+ReloadAllIfChanged() and SetGlobalValue(). Reports expansion latency
+percentiles, the duration of GetTemplate() calls and of each global
+operation, and checks every expansion for torn output. These wall times
+include waiting for the GIL. Next to them, the "native" lines show the
+library calls alone, timed by the module without the GIL (see
+ctemplate._SetNativeTimings()); they still include waiting for the
+template cache lock. ExpandAsync samples are taken on the worker
+threads.
+
+All calls into ctemplate release the GIL, so expansions overlap the
+global operations with Expand() (--sync) as well as ExpandAsync().
+
+The test runs in a child process, so that a crash is reported instead
+of just killing the harness. Run from the top source directory after
+building the module:
+    python tests/stress.py [options]
+The exit status is non-zero on crashes or torn output.
+"""
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from optparse import OptionParser
+sys.path.insert(0, os.getcwd())
+
+ROWS = 50
+
+TEMPLATE = """BEGIN %(version)d {{GLOBAL}}
+{{#ROW}}%(version)d {{VALUE}}
+{{/ROW}}END %(version)d
+"""
+
+# an expansion must come completely from one version of the template
+OUTPUT_RE = re.compile(r"^BEGIN (\d+) g\d+\n(?:\1 x\n){%d}END \1\n$" % ROWS)
+
+GLOBAL_OPS = ("rewrite+ReloadIfChanged", "rewrite+ReloadAllIfChanged",
+              "SetGlobalValue")
+
+
+def percentile (samples, p):
+    """Return the p-th percentile of the sorted list samples."""
+    if not samples:
+        return 0.0
+    index = min(len(samples) - 1, int(len(samples) * p / 100.0))
+    return samples[index]
+
+
+def report (name, samples):
+    samples.sort()
+    print "%-30s n=%-8d p50=%9.1fus p99=%9.1fus p999=%9.1fus max=%9.1fus" % \
+          (name, len(samples), percentile(samples, 50) * 1e6,
+           percentile(samples, 99) * 1e6, percentile(samples, 99.9) * 1e6,
+           percentile(samples, 100) * 1e6)
+
+
+class Stress (object):
+
+    def __init__ (self, options):
+        import ctemplate
+        self.ctemplate = ctemplate
+        self.options = options
+        self.tmpdir = tempfile.mkdtemp()
+        self.filename = os.path.join(self.tmpdir, "stress.tpl")
+        self.version = 0
+        self.mtime = int(time.time())
+        self.write_template()
+        self.stop = threading.Event()
+        self.lock = threading.Lock()
+        # per thread sample lists, merged at the end
+        self.expand_times = []
+        self.reload_expand_times = []
+        self.get_template_times = []
+        self.global_times = dict((name, []) for name in GLOBAL_OPS)
+        self.expansions = 0
+        self.torn = []
+        # number of global operations currently running
+        self.in_global_op = 0
+
+    def write_template (self):
+        """Atomically replace the template with a new version."""
+        self.version += 1
+        tmpname = self.filename + ".tmp"
+        fp = open(tmpname, "w")
+        fp.write(TEMPLATE % {"version": self.version})
+        fp.close()
+        # ctemplate compares mtimes with a resolution of one second
+        self.mtime += 1
+        os.utime(tmpname, (self.mtime, self.mtime))
+        os.rename(tmpname, self.filename)
+
+    def make_dictionary (self):
+        dictionary = self.ctemplate.Dictionary("stress")
+        dictionary.AddSectionRows("ROW", ["VALUE"], [("x",)] * ROWS)
+        return dictionary
+
+    def expander (self):
+        ctemplate = self.ctemplate
+        dictionary = self.make_dictionary()
+        expand_times = []
+        reload_expand_times = []
+        get_template_times = []
+        torn = []
+        count = 0
+        while not self.stop.isSet():
+            start = time.time()
+            template = ctemplate.GetTemplate(self.filename,
+                                             ctemplate.DO_NOT_STRIP)
+            got_template = time.time()
+            during_global_op = self.in_global_op > 0
+            if self.options.sync:
+                output = template.Expand(dictionary)
+            else:
+                output = template.ExpandAsync(dictionary).result()
+            end = time.time()
+            get_template_times.append(got_template - start)
+            if during_global_op or self.in_global_op > 0:
+                reload_expand_times.append(end - got_template)
+            else:
+                expand_times.append(end - got_template)
+            if not OUTPUT_RE.match(output):
+                torn.append(output)
+            count += 1
+        self.lock.acquire()
+        try:
+            self.expand_times.extend(expand_times)
+            self.reload_expand_times.extend(reload_expand_times)
+            self.get_template_times.extend(get_template_times)
+            self.torn.extend(torn)
+            self.expansions += count
+        finally:
+            self.lock.release()
+
+    def global_op (self, name):
+        ctemplate = self.ctemplate
+        start = time.time()
+        if name == "rewrite+ReloadIfChanged":
+            self.write_template()
+            ctemplate.GetTemplate(self.filename,
+                                  ctemplate.DO_NOT_STRIP).ReloadIfChanged()
+        elif name == "rewrite+ReloadAllIfChanged":
+            self.write_template()
+            ctemplate.ReloadAllIfChanged()
+        else:
+            ctemplate.SetGlobalValue("GLOBAL", "g%d" % self.version)
+        return time.time() - start
+
+    def mutator (self):
+        i = 0
+        while not self.stop.isSet():
+            name = GLOBAL_OPS[i % len(GLOBAL_OPS)]
+            self.in_global_op += 1
+            try:
+                duration = self.global_op(name)
+            finally:
+                self.in_global_op -= 1
+            self.global_times[name].append(duration)
+            i += 1
+            self.stop.wait(self.options.interval)
+
+    def run (self):
+        ctemplate = self.ctemplate
+        ctemplate.SetGlobalValue("GLOBAL", "g0")
+        ctemplate.SetExpandThreads(self.options.threads)
+        ctemplate._SetNativeTimings(True)
+        threads = [threading.Thread(target=self.expander)
+                   for i in range(self.options.threads)]
+        threads.append(threading.Thread(target=self.mutator))
+        for thread in threads:
+            thread.start()
+        time.sleep(self.options.duration)
+        self.stop.set()
+        for thread in threads:
+            thread.join()
+        native = ctemplate._GetNativeTimings()
+        ctemplate._SetNativeTimings(False)
+        shutil.rmtree(self.tmpdir)
+        mode = self.options.sync and "Expand" or "ExpandAsync"
+        print "%d threads using %s for %.1fs: %d expansions, " \
+              "%d template versions" % (self.options.threads, mode,
+              self.options.duration, self.expansions, self.version)
+        report("expand", self.expand_times)
+        report("expand during global op", self.reload_expand_times)
+        report("GetTemplate call", self.get_template_times)
+        for name in GLOBAL_OPS:
+            report(name, self.global_times[name])
+        for name in ("GetTemplate", mode, "ReloadIfChanged",
+                     "ReloadAllIfChanged"):
+            report("native " + name, native[name])
+        if self.torn:
+            print "TORN OUTPUT in %d expansions, first one:" % len(self.torn)
+            print repr(self.torn[0])
+            return 1
+        return 0
+
+
+def main (args):
+    parser = OptionParser(usage="%prog [options]")
+    parser.add_option("-t", "--threads", type="int", default=8,
+                      help="number of expanding threads (default 8)")
+    parser.add_option("-d", "--duration", type="float", default=10.0,
+                      help="test duration in seconds (default 10)")
+    parser.add_option("-i", "--interval", type="float", default=0.01,
+                      help="seconds between global operations (default 0.01)")
+    parser.add_option("-s", "--sync", action="store_true", default=False,
+                      help="use Expand() on the Python threads instead of "
+                      "ExpandAsync()")
+    parser.add_option("--child", action="store_true", default=False,
+                      help="run the test in this process")
+    options, rest = parser.parse_args(args)
+    if options.child:
+        return Stress(options).run()
+    # run the test in a child process to detect crashes
+    cmd = [sys.executable, os.path.abspath(__file__), "--child"] + args
+    status = subprocess.call(cmd)
+    if status < 0:
+        print "CRASH: test process killed by signal %d" % -status
+        return 1
+    return status
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
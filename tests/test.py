@@ -3,7 +3,12 @@
 import os
 import sys
 sys.path.insert(0, os.getcwd())
+import array
 import ctemplate
+import select
+import shutil
+import tempfile
+import threading
 import unittest
 
 try:
@@ -76,6 +81,7 @@ class CTemplateTests(unittest.TestCase):
         self.assertEqual(ctemplate.TS_EMPTY, 1)
         self.assertEqual(ctemplate.TS_ERROR, 2)
         self.assertEqual(ctemplate.TS_READY, 3)
+        self.assertEqual(ctemplate.TC_UNUSED, 0)
 
     def _set_global (self):
         ctemplate.SetGlobalValue("GLOBAL_FOO", "bar")
@@ -126,6 +132,345 @@ class CTemplateTests(unittest.TestCase):
         self.assertEqual(template.Expand(dictionary), EXPECTED_RESULT)
         self.assertEqual(ctemplate.GetBadSyntaxList(True, ctemplate.DO_NOT_STRIP), [])
 
+    def _get_template_and_dict (self):
+        filename = os.path.join("tests", "test.tpl")
+        template = ctemplate.Template(filename, ctemplate.DO_NOT_STRIP)
+        dictionary = ctemplate.Dictionary("my example dict")
+        self._set_methods(dictionary)
+        self._set_for_escape_test(dictionary)
+        self._set_dict(dictionary)
+        return template, dictionary
+
+    def test_expand_into (self):
+        template, dictionary = self._get_template_and_dict()
+        expected = template.Expand(dictionary)
+        buf = bytearray("head")
+        self.assertEqual(template.ExpandInto(buf, dictionary), len(expected))
+        template.ExpandInto(buf, dictionary)
+        self.assertEqual(str(buf), "head" + expected + expected)
+        fixed = bytearray(len(expected) + 2)
+        fixed = memoryview(fixed)
+        self.assertEqual(template.ExpandInto(fixed, dictionary, 2), len(expected))
+        self.assertEqual(fixed[2:].tobytes(), expected)
+        self.assertRaises(ValueError, template.ExpandInto, fixed, dictionary, 3)
+        # too small for the last result, the buffer is left alone
+        self.assertEqual(fixed[2:].tobytes(), expected)
+        self.assertRaises(TypeError, template.ExpandInto, 42, dictionary)
+        self.assertRaises(TypeError, template.ExpandInto, "read-only",
+                          dictionary)
+
+    def test_expand_to_buffer (self):
+        template, dictionary = self._get_template_and_dict()
+        expected = template.Expand(dictionary)
+        result = template.ExpandToBuffer(dictionary)
+        self.assertEqual(len(result), len(expected))
+        self.assertEqual(memoryview(result).tobytes(), expected)
+        self.assertEqual(str(result), expected)
+
+    def test_serialize (self):
+        dictionary = ctemplate.Dictionary("my example dict",
+                                          serializable=True)
+        self._set_methods(dictionary)
+        self._set_dict(dictionary)
+        self._set_section(dictionary)
+        self._set_subdict(dictionary)
+        dictionary.SetValueAndShowSection("SVS_FOO", "foo", "SVS")
+        dictionary.SetGlobalValue("TGLOBAL", "tg")
+        include_dict = dictionary.AddIncludeDictionary("INC")
+        include_dict.SetFilename(os.path.join("tests", "test.tpl"))
+        include_dict["INC_FOO"] = "inc"
+        data = dictionary.Serialize()
+        copy = ctemplate.Dictionary.Deserialize(data)
+        self.assertEqual(copy.Dump(), dictionary.Dump())
+        self.assertEqual(copy.Serialize(), data)
+        self.assertRaises(ValueError, include_dict.Serialize)
+        self.assertRaises(ValueError, ctemplate.Dictionary.Deserialize,
+                          data[:-1])
+        self.assertRaises(ValueError, ctemplate.Dictionary.Deserialize, "")
+        self.assertRaises(ValueError, ctemplate.Dictionary("plain").Serialize)
+
+    def test_serialize_overwritten (self):
+        once = ctemplate.Dictionary("overwrite", serializable=True)
+        once["FOO"] = "last"
+        once.ShowSection("SECT")
+        often = ctemplate.Dictionary("overwrite", serializable=True)
+        for i in range(100):
+            often["FOO"] = i
+            often.ShowSection("SECT")
+        often["FOO"] = "last"
+        self.assertEqual(often.Serialize(), once.Serialize())
+        # only the first ShowSection adds an (empty) section dictionary
+        shown = ctemplate.Dictionary("shown", serializable=True)
+        shown.ShowSection("SECT")
+        shown.AddSectionDictionary("SECT")["FOO"] = "bar"
+        shown.ShowSection("SECT")
+        copy = ctemplate.Dictionary.Deserialize(shown.Serialize())
+        self.assertEqual(copy.Dump(), shown.Dump())
+        self.assertTrue("(dict 2 of 2)" in copy.Dump())
+
+    def test_expand_async (self):
+        template, dictionary = self._get_template_and_dict()
+        expected = template.Expand(dictionary)
+        ctemplate.SetExpandThreads(2)
+        fd = ctemplate.GetExpandFd()
+        self.assertEqual(ctemplate.GetExpandFd(), fd)
+        ctemplate.CollectExpanded()
+        pending = set(template.ExpandAsync(dictionary) for i in range(8))
+        while pending:
+            readable = select.select([fd], [], [], 10)[0]
+            self.assertEqual(readable, [fd])
+            for future in ctemplate.CollectExpanded():
+                self.assertTrue(future.done())
+                self.assertEqual(future.result(), expected)
+                pending.remove(future)
+        self.assertEqual(select.select([fd], [], [], 0)[0], [])
+        self.assertRaises(ValueError, ctemplate.SetExpandThreads, 0)
+
+    def test_expand_async_after_fork (self):
+        template, dictionary = self._get_template_and_dict()
+        expected = template.Expand(dictionary)
+        # start the worker threads, the child inherits none of them
+        template.ExpandAsync(dictionary).result()
+        pid = os.fork()
+        if pid == 0:
+            ok = False
+            try:
+                ok = template.ExpandAsync(dictionary).result() == expected
+            finally:
+                os._exit(not ok)
+        self.assertEqual(os.waitpid(pid, 0)[1], 0)
+
+    def test_expand_async_modifier_during_reload (self):
+        # a worker holding the template lock waits for the GIL in the
+        # modifier, so reloading must not hold the GIL
+        tmpdir = tempfile.mkdtemp()
+        try:
+            filename = os.path.join(tmpdir, "modifier.tpl")
+            fp = open(filename, "w")
+            fp.write("{{#ROW}}{{VALUE:x-test-upper}}{{/ROW}}")
+            fp.close()
+            ctemplate.AddModifier("x-test-upper", lambda s, arg: s.upper())
+            template = ctemplate.Template(filename, ctemplate.DO_NOT_STRIP)
+            dictionary = ctemplate.Dictionary("modifier")
+            dictionary.AddSectionRows("ROW", ["VALUE"], [("a",)] * 100)
+            futures = [template.ExpandAsync(dictionary) for i in range(8)]
+            for i in range(20):
+                template.ReloadIfChanged()
+                ctemplate.ReloadAllIfChanged()
+                ctemplate.Template(filename, ctemplate.DO_NOT_STRIP)
+            for future in futures:
+                self.assertEqual(future.result(), "A" * 100)
+        finally:
+            shutil.rmtree(tmpdir)
+
+    def test_expand_locks_dictionary (self):
+        tmpdir = tempfile.mkdtemp()
+        try:
+            filename = os.path.join(tmpdir, "wait.tpl")
+            fp = open(filename, "w")
+            fp.write("{{VALUE:x-test-wait}}")
+            fp.close()
+            started = threading.Event()
+            release = threading.Event()
+            def wait (s, arg):
+                started.set()
+                release.wait(10)
+                return s
+            ctemplate.AddModifier("x-test-wait", wait)
+            template = ctemplate.Template(filename, ctemplate.DO_NOT_STRIP)
+            dictionary = ctemplate.Dictionary("wait")
+            dictionary["VALUE"] = "v"
+            section = dictionary.AddSectionDictionary("SECT")
+            future = template.ExpandAsync(dictionary)
+            self.assertTrue(started.wait(10))
+            self.assertRaises(RuntimeError, dictionary.__setitem__,
+                              "VALUE", "w")
+            self.assertRaises(RuntimeError, section.ShowSection, "SUB")
+            self.assertRaises(RuntimeError, dictionary.AddSectionRows,
+                              "ROW", ["VALUE"], [("x",)])
+            release.set()
+            self.assertEqual(future.result(), "v")
+            dictionary["VALUE"] = "w"
+            self.assertEqual(template.Expand(dictionary), "w")
+        finally:
+            shutil.rmtree(tmpdir)
+
+    def test_add_section_rows (self):
+        expected = ctemplate.Dictionary("rows")
+        for name, count, price, flag in (("a", 1, 0.5, True),
+                                         ("b", 2, 1.25, False)):
+            sub_dict = expected.AddSectionDictionary("ROW")
+            sub_dict["NAME"] = name
+            sub_dict["COUNT"] = count
+            sub_dict["PRICE"] = price
+            sub_dict["FLAG"] = flag
+        columns = ["NAME", "COUNT", "PRICE", "FLAG"]
+        dictionary = ctemplate.Dictionary("rows")
+        rows = iter([("a", 1, 0.5, True), ("b", 2, 1.25, False)])
+        self.assertEqual(dictionary.AddSectionRows("ROW", columns, rows), 2)
+        self.assertEqual(dictionary.Dump(), expected.Dump())
+        dictionary = ctemplate.Dictionary("rows", serializable=True)
+        data = [["a", "b"], array.array("i", [1, 2]),
+                array.array("d", [0.5, 1.25]), [True, False]]
+        self.assertEqual(dictionary.AddSectionRows("ROW", columns, data,
+                                                   True), 2)
+        self.assertEqual(dictionary.Dump(), expected.Dump())
+        self.assertEqual(ctemplate.Dictionary.Deserialize(
+            dictionary.Serialize()).Dump(), expected.Dump())
+        self.assertRaises(ValueError, dictionary.AddSectionRows, "ROW",
+                          columns, [("a", 1)])
+        self.assertRaises(ValueError, dictionary.AddSectionRows, "ROW",
+                          columns, [["a"], [1, 2], [0.5], [True]], True)
+        # a buffer of items other than numbers is read as a sequence
+        dictionary = ctemplate.Dictionary("rows")
+        data = [array.array("u", u"ab"), [1, 2], [0.5, 1.25], [True, False]]
+        self.assertEqual(dictionary.AddSectionRows("ROW", columns, data,
+                                                   True), 2)
+        self.assertEqual(dictionary.Dump(), expected.Dump())
+
+    def test_memory_usage (self):
+        dictionary = ctemplate.Dictionary("usage", serializable=True)
+        dictionary["FOO"] = "bar"
+        sub_dict = dictionary.AddSectionDictionary("SUB")
+        sub_dict["X"] = 12
+        dictionary.AddIncludeDictionary("INC")
+        usage = sub_dict.MemoryUsage()
+        self.assertEqual(usage, dictionary.MemoryUsage())
+        self.assertEqual(usage["dictionaries"], 3)
+        self.assertEqual(usage["set_calls"], 2)
+        self.assertEqual(usage["set_bytes"], 9)
+        self.assertTrue(usage["journal_bytes"] > 0)
+        # overwrites are counted, ShowSection() adds a dictionary only to
+        # a section without any
+        dictionary["FOO"] = "baz"
+        dictionary.ShowSection("SUB")
+        dictionary.ShowSection("SHOWN")
+        dictionary.ShowSection("SHOWN")
+        usage = dictionary.MemoryUsage()
+        self.assertEqual(usage["dictionaries"], 4)
+        self.assertEqual(usage["set_calls"], 3)
+        self.assertEqual(usage["set_bytes"], 15)
+        # the serialized journal keeps only the last value of each name
+        copy = ctemplate.Dictionary.Deserialize(dictionary.Serialize())
+        usage = copy.MemoryUsage()
+        self.assertEqual(usage["dictionaries"], 4)
+        self.assertEqual(usage["set_calls"], 2)
+        self.assertEqual(usage["set_bytes"], 9)
+        self.assertEqual(ctemplate.Dictionary("plain").MemoryUsage()
+                         ["journal_bytes"], 0)
+
+    def test_auto_escape (self):
+        tmpdir = tempfile.mkdtemp()
+        try:
+            filename = os.path.join(tmpdir, "escape.tpl")
+            fp = open(filename, "w")
+            fp.write("{{VALUE}}")
+            fp.close()
+            dictionary = ctemplate.Dictionary("escape")
+            dictionary["VALUE"] = "<b>"
+            template = ctemplate.Template(filename, ctemplate.DO_NOT_STRIP,
+                                          ctemplate.TC_HTML)
+            self.assertEqual(template.Expand(dictionary), "&lt;b&gt;")
+            template = ctemplate.GetTemplate(filename, ctemplate.DO_NOT_STRIP,
+                                             ctemplate.TC_HTML)
+            self.assertEqual(template.Expand(dictionary), "&lt;b&gt;")
+            template = ctemplate.Template(filename, ctemplate.DO_NOT_STRIP,
+                                          ctemplate.TC_MANUAL)
+            self.assertEqual(template.Expand(dictionary), "<b>")
+            self.assertRaises(ValueError, ctemplate.Template, filename,
+                              ctemplate.DO_NOT_STRIP, 99)
+            # a changed file is picked up by the reload functions
+            html = ctemplate.Template(filename, ctemplate.DO_NOT_STRIP,
+                                      ctemplate.TC_HTML)
+            fp = open(filename, "w")
+            fp.write("[{{VALUE}}]")
+            fp.close()
+            mtime = os.stat(filename).st_mtime + 10
+            os.utime(filename, (mtime, mtime))
+            ctemplate.ReloadAllIfChanged()
+            template = ctemplate.Template(filename, ctemplate.DO_NOT_STRIP,
+                                          ctemplate.TC_HTML)
+            self.assertEqual(template.Expand(dictionary), "[&lt;b&gt;]")
+            self.assertEqual(html.Expand(dictionary), "&lt;b&gt;")
+            self.assertTrue(html.ReloadIfChanged())
+            self.assertEqual(html.Expand(dictionary), "[&lt;b&gt;]")
+            # the file's own pragma may follow whitespace and comments
+            filename = os.path.join(tmpdir, "pragma.tpl")
+            fp = open(filename, "w")
+            fp.write(' {{! JSON only }}\n{{%AUTOESCAPE context="JSON"}}'
+                     '{{VALUE}}')
+            fp.close()
+            dictionary["VALUE"] = '"'
+            template = ctemplate.Template(filename, ctemplate.DO_NOT_STRIP,
+                                          ctemplate.TC_HTML)
+            self.assertEqual(template.Expand(dictionary).strip(), '\\"')
+        finally:
+            shutil.rmtree(tmpdir)
+
+    def test_native_timings (self):
+        dictionary = ctemplate.Dictionary("timings")
+        ctemplate._SetNativeTimings(True)
+        try:
+            filename = os.path.join("tests", "test.tpl")
+            template = ctemplate.Template(filename, ctemplate.DO_NOT_STRIP)
+            template.Expand(dictionary)
+            template.ReloadIfChanged()
+            timings = ctemplate._GetNativeTimings()
+            self.assertEqual(len(timings["GetTemplate"]), 1)
+            self.assertEqual(len(timings["Expand"]), 1)
+            self.assertEqual(len(timings["ReloadIfChanged"]), 1)
+            self.assertTrue(timings["Expand"][0] >= 0)
+            self.assertEqual(ctemplate._GetNativeTimings()["Expand"], [])
+        finally:
+            ctemplate._SetNativeTimings(False)
+
+    def test_search_path (self):
+        tmpdir = tempfile.mkdtemp()
+        try:
+            theme = os.path.join(tmpdir, "theme")
+            default = os.path.join(tmpdir, "default")
+            os.mkdir(theme)
+            os.mkdir(default)
+            for dirname in (theme, default):
+                fp = open(os.path.join(dirname, "page.tpl"), "w")
+                fp.write(os.path.basename(dirname))
+                fp.close()
+            fp = open(os.path.join(default, "base.tpl"), "w")
+            fp.write("base")
+            fp.close()
+            fp = open(os.path.join(default, "outer.tpl"), "w")
+            fp.write("[{{>INC}}]")
+            fp.close()
+            ctemplate.SetTemplateSearchPath([theme, default])
+            self.assertEqual(ctemplate.GetTemplateSearchPath(), [theme, default])
+            dictionary = ctemplate.Dictionary("search path")
+            template = ctemplate.Template("page.tpl", ctemplate.DO_NOT_STRIP)
+            self.assertEqual(template.Expand(dictionary), "theme")
+            template = ctemplate.Template("base.tpl", ctemplate.DO_NOT_STRIP)
+            self.assertEqual(template.Expand(dictionary), "base")
+            # include filenames are looked up too
+            outer = ctemplate.Dictionary("outer")
+            outer.AddIncludeDictionary("INC").SetFilename("page.tpl")
+            template = ctemplate.Template("outer.tpl", ctemplate.DO_NOT_STRIP)
+            self.assertEqual(template.Expand(outer), "[theme]")
+            self.assertRaises(IOError, ctemplate.Template, "missing.tpl",
+                              ctemplate.DO_NOT_STRIP)
+            # negative lookups are cached until the next reload
+            fp = open(os.path.join(theme, "missing.tpl"), "w")
+            fp.write("found")
+            fp.close()
+            self.assertRaises(IOError, ctemplate.Template, "missing.tpl",
+                              ctemplate.DO_NOT_STRIP)
+            template.ReloadIfChanged()
+            self.assertRaises(IOError, ctemplate.Template, "missing.tpl",
+                              ctemplate.DO_NOT_STRIP)
+            ctemplate.ReloadAllIfChanged()
+            template = ctemplate.Template("missing.tpl", ctemplate.DO_NOT_STRIP)
+            self.assertEqual(template.Expand(dictionary), "found")
+        finally:
+            ctemplate.SetTemplateSearchPath([])
+            shutil.rmtree(tmpdir)
+
 
 if __name__ == '__main__':
     if tappy_available:
@@ -0,0 +1,88 @@
+#!/usr/bin/python
+# -*- coding: iso-8859-1 -*-
+"""Representative expansion workload.
+
+Used to train the profile-guided build (see the pgobuild target in the
+Makefile) with the default options. The pgobench target compares the
+builds with other row counts and with the bulk path alone, so the
+measurement does not just replay the training run.
+Run from the top source directory after building the module:
+    python tests/workload.py [options] [iterations]
+"""
+import os
+import sys
+import time
+from optparse import OptionParser
+sys.path.insert(0, os.getcwd())
+import ctemplate
+
+TEMPLATE = os.path.join("tests", "workload.tpl")
+HEADER = os.path.join("tests", "workload_header.tpl")
+
+
+def make_dictionary (rows):
+    dictionary = ctemplate.Dictionary("workload")
+    dictionary["TITLE"] = "Items <all>"
+    dictionary["FOOTER"] = "generated by tests/workload.py"
+    header = dictionary.AddIncludeDictionary("HEADER")
+    header.SetFilename(HEADER)
+    header["USER"] = "J. Doe & Co."
+    for i in range(8):
+        nav = header.AddSectionDictionary("NAV")
+        nav["URL"] = "/section/%d" % i
+        nav["LABEL"] = "Section <%d>" % i
+    for i in range(rows):
+        row = dictionary.AddSectionDictionary("ROW")
+        row["ROW_CLASS"] = ("odd", "even")[i % 2]
+        row["ID"] = i
+        row["NAME"] = "item '%d'" % i
+        row["PRICE"] = i * 0.25
+        row["COUNT"] = i % 17
+        row["DESCRIPTION"] = "Description of <item> %d & more" % i
+        row["IN_STOCK"] = bool(i % 3)
+    return dictionary
+
+
+def make_dictionary_bulk (rows):
+    dictionary = ctemplate.Dictionary("workload")
+    dictionary["TITLE"] = "Items <all>"
+    columns = ["ROW_CLASS", "ID", "NAME", "PRICE", "DESCRIPTION"]
+    rows = [(("odd", "even")[i % 2], i, "item '%d'" % i, i * 0.25,
+             "Description of <item> %d & more" % i) for i in range(rows)]
+    dictionary.AddSectionRows("ROW", columns, rows)
+    return dictionary
+
+
+def run (iterations, rows, bulk_only):
+    template = ctemplate.Template(TEMPLATE, ctemplate.STRIP_BLANK_LINES)
+    start = time.time()
+    size = 0
+    for i in range(iterations):
+        if not bulk_only:
+            dictionary = make_dictionary(rows)
+            size += len(template.Expand(dictionary))
+        page = bytearray()
+        template.ExpandInto(page, make_dictionary_bulk(rows))
+        size += len(page)
+    elapsed = time.time() - start
+    return elapsed, size
+
+
+def main (args):
+    parser = OptionParser(usage="%prog [options] [iterations]")
+    parser.add_option("-r", "--rows", type="int", default=200,
+                      help="rows per page (default 200)")
+    parser.add_option("-b", "--bulk-only", action="store_true",
+                      default=False,
+                      help="only fill pages with AddSectionRows()")
+    options, rest = parser.parse_args(args)
+    iterations = 200
+    if rest:
+        iterations = int(rest[0])
+    elapsed, size = run(iterations, options.rows, options.bulk_only)
+    print "%d iterations, %d bytes in %.3f s (%.1f us/iteration)" % \
+          (iterations, size, elapsed, elapsed * 1e6 / iterations)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
@@ -0,0 +1,14 @@
+{{! representative page used by tests/workload.py to train and measure
+    the profile-guided build}}
+<html>
+<head><title>{{TITLE:html_escape}}</title></head>
+<body>
+{{>HEADER}}
+<table>
+{{#ROW}}<tr class="{{ROW_CLASS}}"><td>{{ID}}</td><td>{{NAME:html_escape}}</td><td>{{PRICE}}</td><td>{{COUNT}}</td><td><a href="/item?id={{ID:url_query_escape}}" onclick="show('{{NAME:javascript_escape}}')">{{DESCRIPTION:html_escape}}</a></td>{{#IN_STOCK}}<td>in stock</td>{{/IN_STOCK}}</tr>
+{{/ROW}}
+</table>
+{{#EMPTY}}<p>No items.</p>{{/EMPTY}}
+<p>{{FOOTER}}</p>
+</body>
+</html>
@@ -0,0 +1,4 @@
+<div id="header">
+{{#NAV}}<a href="{{URL}}">{{LABEL:html_escape}}</a>{{#NAV_separator}} | {{/NAV_separator}}{{/NAV}}
+<span>{{USER:html_escape}}</span>
+</div>